@@ -0,0 +1,305 @@
+## results = benchmark_saveload ()
+## results = benchmark_saveload ("name", value, ...)
+##
+## Time saving and loading synthetic classdef objects with saveclass /
+## loadclass and matiotest, against Octave's own save / load of the same
+## properties.  The cases vary the number of properties, the number of
+## elements per property, the element type and how deeply each value is
+## nested in structs and cells.  For each case and method the save and load
+## throughput (MB/s and objects/s), the file size and the peak resident set
+## size are printed and returned as a struct array.
+##
+## Options:
+##   "reps"     timed repetitions per case, the median is reported (3)
+##   "nprops"   property counts to try ([4 32])
+##   "numel"    elements per property ([1e3 1e5])
+##   "types"    element types ({"double", "single", "int32", "char",
+##              "logical", "sparse"})
+##   "depth"    nesting depths ([0 3])
+##   "methods"  methods to run, any of "saveclass", "matio-v73",
+##              "matio-v7", "matio-direct", "octave-hdf5", "octave-v7"
+##              (all)
+##   "dir"      scratch directory (a new one under tempdir)
+##
+## Octave has no save -v7.3; its HDF5 format (save -hdf5) is the closest
+## equivalent and is what "octave-hdf5" uses.  Octave can't save classdef
+## objects either, so the built-in methods save the struct that saveobj
+## returns.  "matio-direct" loads a class without loadobj, which takes the
+## direct property assignment path.
+##
+## Peak RSS is read from VmHWM in /proc/self/status after resetting it
+## through /proc/self/clear_refs, so it is only reported on Linux.
+##
+## The .oct files must be on the path.  Run from the build directory, e.g.
+##   r = benchmark_saveload ("reps", 5, "numel", [1e4 1e6]);
+
+function results = benchmark_saveload (varargin)
+
+  opts = struct ("reps", 3,
+                 "nprops", [4 32],
+                 "numel", [1e3 1e5],
+                 "types", {{"double", "single", "int32", "char", "logical", "sparse"}},
+                 "depth", [0 3],
+                 "methods", {{"saveclass", "matio-v73", "matio-v7", "matio-direct", ...
+                              "octave-hdf5", "octave-v7"}},
+                 "dir", "");
+
+  if (mod (numel (varargin), 2) != 0)
+    error ("benchmark_saveload: options must be name/value pairs");
+  endif
+  for i = 1:2:numel (varargin)
+    name = varargin{i};
+    if (! isfield (opts, name))
+      error ("benchmark_saveload: unknown option '%s'", name);
+    endif
+    opts.(name) = varargin{i+1};
+  endfor
+
+  if (isempty (opts.dir))
+    opts.dir = tempname ();
+  endif
+  mkdir (opts.dir);
+  olddir = cd (opts.dir);
+  oldpath = addpath (opts.dir);
+  unwind_protect
+
+    rand ("state", 42);
+    results = struct ([]);
+
+    printf ("%-7s %6s %-8s %5s %-13s %9s %9s %9s %9s %8s %8s\n",
+            "nprops", "numel", "type", "depth", "method",
+            "save MB/s", "load MB/s", "save ob/s", "load ob/s",
+            "file MB", "peak MB");
+
+    for nprops = opts.nprops
+      cls = write_class (opts.dir, nprops, true);
+      cls_direct = write_class (opts.dir, nprops, false);
+      for n = opts.numel
+        for t = 1:numel (opts.types)
+          type = opts.types{t};
+          for depth = opts.depth
+            s = make_props (nprops, n, type, depth);
+            info = whos ("s");
+            mb = info.bytes / 2^20;
+
+            for m = 1:numel (opts.methods)
+              method = opts.methods{m};
+              clsname = ifelse_str (strcmp (method, "matio-direct"), cls_direct, cls);
+              obj = feval (clsname);
+              for k = 1:nprops
+                obj.(sprintf ("p%d", k)) = s.(sprintf ("p%d", k));
+              endfor
+
+              [t_save, t_load, bytes, peak, ok] = run_method (method, obj, s, clsname, opts.reps);
+
+              r.nprops = nprops;
+              r.numel = n;
+              r.type = type;
+              r.depth = depth;
+              r.method = method;
+              r.mbytes = mb;
+              r.save_mbps = mb / t_save;
+              r.load_mbps = mb / t_load;
+              r.save_objps = 1 / t_save;
+              r.load_objps = 1 / t_load;
+              r.file_mb = bytes / 2^20;
+              r.peak_rss_mb = peak;
+              r.roundtrip_ok = ok;
+              results = [results, r];
+
+              printf ("%-7d %6d %-8s %5d %-13s %9.1f %9.1f %9.1f %9.1f %8.2f %8.1f%s\n",
+                      nprops, n, type, depth, method,
+                      r.save_mbps, r.load_mbps, r.save_objps, r.load_objps,
+                      r.file_mb, peak, ifelse_str (ok, "", "  MISMATCH"));
+            endfor
+          endfor
+        endfor
+      endfor
+    endfor
+
+  unwind_protect_cleanup
+    cd (olddir);
+    path (oldpath);
+    confirm_recursive_rmdir (false, "local");
+    rmdir (opts.dir, "s");
+  end_unwind_protect
+
+endfunction
+
+## Write a value class with nprops properties p1, p2, ... to dir.  With
+## loadobj, it follows the matiotest convention: saveobj returns a struct of
+## the properties and the static loadobj (obj, s) copies them back.
+function name = write_class (dir, nprops, with_loadobj)
+
+  name = sprintf ("BenchObj%d%s", nprops, ifelse_str (with_loadobj, "", "Direct"));
+  fid = fopen (fullfile (dir, [name ".m"]), "w");
+  fprintf (fid, "classdef %s\n  properties\n", name);
+  fprintf (fid, "    p%d\n", 1:nprops);
+  fprintf (fid, "  end\n  methods\n");
+  fprintf (fid, "    function s = saveobj (obj)\n");
+  fprintf (fid, "      s = struct ();\n");
+  fprintf (fid, "      for k = 1:%d\n", nprops);
+  fprintf (fid, "        f = sprintf ('p%%d', k);\n        s.(f) = obj.(f);\n");
+  fprintf (fid, "      end\n    end\n  end\n");
+  if (with_loadobj)
+    fprintf (fid, "  methods (Static)\n");
+    fprintf (fid, "    function obj = loadobj (obj, s)\n");
+    fprintf (fid, "      f = fieldnames (s);\n");
+    fprintf (fid, "      for k = 1:numel (f)\n        obj.(f{k}) = s.(f{k});\n      end\n");
+    fprintf (fid, "    end\n  end\n");
+  endif
+  fprintf (fid, "end\n");
+  fclose (fid);
+  rehash ();
+
+endfunction
+
+function s = make_props (nprops, n, type, depth)
+
+  s = struct ();
+  for k = 1:nprops
+    switch (type)
+      case "double"
+        v = rand (n, 1);
+      case "single"
+        v = single (rand (n, 1));
+      case "int32"
+        v = int32 (randi (1e6, n, 1));
+      case "char"
+        v = char (randi ([32 126], 1, n));
+      case "logical"
+        v = rand (n, 1) > 0.5;
+      case "sparse"
+        ## about n nonzeros
+        v = sprand (n, 10, 0.1);
+      otherwise
+        error ("benchmark_saveload: unknown type '%s'", type);
+    endswitch
+
+    ## Alternate struct and cell levels
+    for d = 1:depth
+      if (mod (d, 2))
+        v = struct ("child", {v});
+      else
+        v = {v};
+      endif
+    endfor
+
+    s.(sprintf ("p%d", k)) = v;
+  endfor
+
+endfunction
+
+function [t_save, t_load, bytes, peak, ok] = run_method (method, obj, s, clsname, reps)
+
+  switch (method)
+    case "saveclass"
+      ## loadclass finds the class from the file name
+      file = clsname;
+    case "octave-hdf5"
+      file = [clsname ".h5"];
+    otherwise
+      file = [clsname ".mat"];
+  endswitch
+
+  reset_peak_rss ();
+
+  ts = zeros (reps, 1);
+  tl = zeros (reps, 1);
+  for i = 1:reps
+    id = tic ();
+    evalc ("save_with (method, file, obj, s);");
+    ts(i) = toc (id);
+
+    id = tic ();
+    evalc ("loaded = load_with (method, file, clsname);");
+    tl(i) = toc (id);
+  endfor
+
+  peak = peak_rss_mb ();
+  t_save = median (ts);
+  t_load = median (tl);
+
+  d = dir (file);
+  bytes = d.bytes;
+  delete (file);
+
+  ok = true;
+  for k = 1:numel (fieldnames (s))
+    f = sprintf ("p%d", k);
+    ok = ok && isequal (loaded.(f), s.(f));
+  endfor
+
+endfunction
+
+## The output of the DLD functions is captured by evalc in run_method, so
+## what they print is timed but not shown
+function save_with (method, file, obj, s)
+
+  switch (method)
+    case "saveclass"
+      saveclass (obj, file);
+    case {"matio-v73", "matio-direct"}
+      matiotest ("w", file, obj, "format", "v73");
+    case "matio-v7"
+      matiotest ("w", file, obj, "format", "v7");
+    case "octave-hdf5"
+      save ("-hdf5", file, "-struct", "s");
+    case "octave-v7"
+      save ("-v7", file, "-struct", "s");
+    otherwise
+      error ("benchmark_saveload: unknown method '%s'", method);
+  endswitch
+
+endfunction
+
+function loaded = load_with (method, file, clsname)
+
+  switch (method)
+    case "saveclass"
+      loaded = loadclass (file);
+    case {"matio-v73", "matio-direct", "matio-v7"}
+      loaded = matiotest ("r", file, clsname);
+    otherwise
+      loaded = load (file);
+  endswitch
+
+endfunction
+
+function reset_peak_rss ()
+
+  ## Writing 5 resets VmHWM to the current RSS (Linux 4.0 and later)
+  [fid, msg] = fopen ("/proc/self/clear_refs", "w");
+  if (fid >= 0)
+    fputs (fid, "5");
+    fclose (fid);
+  endif
+
+endfunction
+
+function mb = peak_rss_mb ()
+
+  mb = NaN;
+  fid = fopen ("/proc/self/status", "r");
+  if (fid < 0)
+    return;
+  endif
+  while (ischar (line = fgetl (fid)))
+    if (strncmp (line, "VmHWM:", 6))
+      mb = sscanf (line(7:end), "%d") / 1024;
+      break;
+    endif
+  endwhile
+  fclose (fid);
+
+endfunction
+
+function s = ifelse_str (cond, a, b)
+
+  if (cond)
+    s = a;
+  else
+    s = b;
+  endif
+
+endfunction
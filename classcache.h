@@ -0,0 +1,234 @@
+#if ! defined (classcache_h)
+#define classcache_h 1
+
+#include <octave/oct.h>
+#include <octave/cdef-class.h>
+#include <octave/cdef-manager.h>
+#include <octave/cdef-method.h>
+#include <octave/cdef-object.h>
+#include <octave/cdef-property.h>
+#include <octave/cdef-utils.h>
+#include <octave/interpreter.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Everything the save/load paths need to know about a classdef class.  It
+// is resolved once per class instead of copying the method and property maps
+// and searching them by name on every call.
+struct class_info
+{
+    struct property
+    {
+        std::string name;
+        octave::cdef_property prop;
+
+        bool transient = false;
+        bool dependent = false;
+        bool constant = false;
+
+        // Listed in the class's NoSave constant (see make_class_info)
+        bool nosave = false;
+
+        // Whether the property is written when an object is saved.  Skipped
+        // properties are never read, so Dependent getters don't run.
+        bool is_saved() const
+        {
+            return !(transient || dependent || constant || nosave);
+        }
+    };
+
+    octave::cdef_class cls;
+
+    // Run the constructor (with no arguments) when an object is loaded
+    bool construct_on_load = false;
+
+    // Not ok () if the class doesn't define the method
+    octave::cdef_method loadobj;
+    octave::cdef_method saveobj;
+
+    // In declaration order
+    std::vector<property> properties;
+};
+
+typedef std::map<std::string, class_info> class_cache_map;
+
+// The cache is deliberately never destroyed: it holds references to cdef
+// objects, and running their destructors after the interpreter is gone at
+// exit would crash.  Each .oct file has its own cache.
+inline class_cache_map& class_cache()
+{
+    static class_cache_map *cache = new class_cache_map ();
+    return *cache;
+}
+
+inline void clear_class_cache()
+{
+    class_cache().clear();
+}
+
+inline class_info make_class_info(const octave::cdef_class& cls)
+{
+    class_info info;
+    info.cls = cls;
+
+    octave_value construct_on_load = cls.get("ConstructOnLoad");
+    info.construct_on_load = construct_on_load.is_defined() && construct_on_load.bool_value();
+
+    octave::cdef_method meth = cls.find_method("loadobj");
+    if (meth.ok()) {
+        info.loadobj = meth;
+    }
+    meth = cls.find_method("saveobj");
+    if (meth.ok()) {
+        info.saveobj = meth;
+    }
+
+    std::map<octave::property_key, octave::cdef_property> properties = cls.get_property_map();
+    for (const auto& property : properties) {
+        class_info::property p;
+        p.name = property.first.second;
+        p.prop = property.second;
+        p.transient = p.prop.get("Transient").bool_value();
+        p.dependent = p.prop.get("Dependent").bool_value();
+        p.constant = p.prop.get("Constant").bool_value();
+        info.properties.push_back(p);
+    }
+
+    // A class can exclude more properties from saving with a constant
+    // property named NoSave holding their names, e.g.
+    //   properties (Constant)
+    //     NoSave = {'cache', 'plot_handle'};
+    //   end
+    for (const auto& p : info.properties) {
+        if (p.name == "NoSave" && p.constant) {
+            octave_value names = p.prop.get_value(false);
+            if (names.iscellstr()) {
+                string_vector nosave = names.string_vector_value();
+                for (auto& q : info.properties) {
+                    for (octave_idx_type i = 0; i < nosave.numel(); ++i) {
+                        if (q.name == nosave(i)) {
+                            q.nosave = true;
+                        }
+                    }
+                }
+            }
+            break;
+        }
+    }
+
+    return info;
+}
+
+// Entries are keyed by class name and checked against the class object they
+// were built from.  When Octave reloads an edited classdef file it creates a
+// new cdef_class, so a stale entry no longer matches and is rebuilt.
+inline const class_info& lookup_class(const octave::cdef_class& cls)
+{
+    class_cache_map& cache = class_cache();
+    std::string name = cls.get_name();
+
+    auto it = cache.find(name);
+    if (it != cache.end() && it->second.cls == cls) {
+        return it->second;
+    }
+
+    class_info& info = cache[name];
+    info = make_class_info(cls);
+    return info;
+}
+
+// who is the function name used in the error message
+inline const class_info& lookup_class(const std::string& name, const char *who)
+{
+    octave::interpreter *interp = octave::interpreter::the_interpreter();
+    octave::cdef_manager& cdef_mgr = interp->get_cdef_manager();
+
+    octave::cdef_class cls = cdef_mgr.find_class(name, false);
+    if (!cls.ok()) {
+        error("%s: class not found: %s", who, name.c_str());
+    }
+
+    return lookup_class(cls);
+}
+
+// An object to load saved properties into.  Like MATLAB, the constructor
+// only runs for classes with ConstructOnLoad; otherwise the object is
+// allocated and given its default property values, which is what the
+// constructor would start from.
+inline octave::cdef_object allocate_object(const class_info& info)
+{
+    octave::cdef_class cls = info.cls;
+
+    if (info.construct_on_load) {
+        return octave::to_cdef(cls.construct(octave_value_list()));
+    }
+
+    octave::cdef_object obj;
+    if (cls.is_handle_class()) {
+        obj = octave::cdef_object (new octave::handle_cdef_object ());
+    } else {
+        obj = octave::cdef_object (new octave::value_cdef_object ());
+    }
+
+    obj.set_class(cls);
+    cls.initialize_object(obj);
+    obj.mark_as_constructed();
+
+    return obj;
+}
+
+// Store the saved properties in st straight into obj.  Set methods and
+// validation don't run, as they don't when MATLAB loads an object.  Fields
+// that aren't saved properties of the class are ignored.
+inline void assign_properties(octave::cdef_object& obj, const class_info& info,
+                              const octave_scalar_map& st)
+{
+    for (const auto& property : info.properties) {
+        if (property.is_saved() && st.isfield(property.name)) {
+            obj.set_property(0, property.name, st.getfield(property.name));
+        }
+    }
+}
+
+// Classes with a static loadobj get a constructed object and the usual
+// (obj, struct) loadobj call.  All others skip both: the object is
+// allocated without running the constructor and the properties are
+// assigned directly.
+inline bool uses_loadobj(const class_info& info)
+{
+    return info.loadobj.ok() && info.loadobj.is_static();
+}
+
+inline octave::cdef_object new_object(const class_info& info)
+{
+    if (uses_loadobj(info)) {
+        return octave::to_cdef(octave::cdef_class (info.cls).construct(octave_value_list()));
+    }
+
+    return allocate_object(info);
+}
+
+// Build an object from its saved properties.  obj is an object made by
+// new_object to load into, or invalid to make a new one.
+inline octave_value load_object(const class_info& info, const octave_scalar_map& st,
+                                octave::cdef_object obj = octave::cdef_object ())
+{
+    if (!obj.ok()) {
+        obj = new_object(info);
+    }
+
+    if (uses_loadobj(info)) {
+        octave::cdef_method loadobj_method = info.loadobj;
+        octave_value_list args;
+        args(0) = octave::to_ov(obj);
+        args(1) = octave_value(st);
+        return loadobj_method.execute(args, 1)(0);
+    }
+
+    assign_properties(obj, info, st);
+    return octave::to_ov(obj);
+}
+
+#endif
@@ -6,11 +6,117 @@
 
 #include <octave/ov-struct.h>
 
+#include <octave/ls-oct-binary.h>
 #include <octave/ls-oct-text.h>
+#include <octave/mach-info.h>
 
 #include <octave/interpreter.h>
 
+#include "classcache.h"
+
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <streambuf>
+
+#if defined (__unix__) || defined (__APPLE__)
+#  define LOADCLASS_HAVE_MMAP 1
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+// Read-only std::streambuf over a memory mapped file, so Octave's stream
+// decoders read straight from the page cache instead of copying every block
+// through an ifstream buffer first.
+class mmap_streambuf : public std::streambuf
+{
+public:
+    explicit mmap_streambuf(const std::string& filename)
+    {
+#if defined (LOADCLASS_HAVE_MMAP)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat sb;
+        if (::fstat(fd, &sb) == 0 && sb.st_size > 0) {
+            void *addr = ::mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                m_data = static_cast<char *> (addr);
+                m_size = sb.st_size;
+                ::madvise(addr, m_size, MADV_SEQUENTIAL);
+                setg(m_data, m_data, m_data + m_size);
+            }
+        }
+
+        ::close(fd);
+#else
+        octave_unused_parameter (filename);
+#endif
+    }
+
+    mmap_streambuf(const mmap_streambuf&) = delete;
+    mmap_streambuf& operator = (const mmap_streambuf&) = delete;
+
+    ~mmap_streambuf()
+    {
+#if defined (LOADCLASS_HAVE_MMAP)
+        if (m_data) {
+            ::munmap(m_data, m_size);
+        }
+#endif
+    }
+
+    bool is_open() const { return m_data != nullptr; }
+
+protected:
+    std::streamsize xsgetn(char *s, std::streamsize n) override
+    {
+        std::streamsize avail = egptr() - gptr();
+        if (n > avail) {
+            n = avail;
+        }
+        std::memcpy(s, gptr(), n);
+        setg(eback(), gptr() + n, egptr());
+        return n;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which = std::ios_base::in) override
+    {
+        if (!(which & std::ios_base::in)) {
+            return pos_type(off_type(-1));
+        }
+
+        off_type pos;
+        if (dir == std::ios_base::beg) {
+            pos = off;
+        } else if (dir == std::ios_base::cur) {
+            pos = (gptr() - eback()) + off;
+        } else {
+            pos = static_cast<off_type> (m_size) + off;
+        }
+
+        if (pos < 0 || pos > static_cast<off_type> (m_size)) {
+            return pos_type(off_type(-1));
+        }
+
+        setg(m_data, m_data + pos, m_data + m_size);
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in) override
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+private:
+    char *m_data = nullptr;
+    std::size_t m_size = 0;
+};
 
 // args: octave_value_list
 // Return type of DLD is always octave_value_list
@@ -32,53 +138,98 @@ DEFUN_DLD (loadclass, args, nargout,
     } 
     const std::string filename = args(0).string_value();
 
-    // We'll check the second argument later
+    // '-verbose' lists the properties read from the file
+    bool verbose = false;
+    if (nargin > 1) {
+        if (!args(1).is_string() || args(1).string_value() != "-verbose") {
+            error("loadclass: unknown option, expected '-verbose'.");
+        }
+        verbose = true;
+    }
 
-    std::ifstream file (filename);
-    if (!file) {
-        error("loadclass: could not open file for reading.");
+    // Map the file if we can, fall back to a plain ifstream otherwise
+    mmap_streambuf mapped (filename);
+    std::ifstream fallback;
+    std::istream file (nullptr);
+    if (mapped.is_open()) {
+        file.rdbuf(&mapped);
+    } else {
+        fallback.open(filename, std::ios::in | std::ios::binary);
+        if (!fallback) {
+            error("loadclass: could not open file for reading.");
+        }
+        file.rdbuf(fallback.rdbuf());
     }
 
+    // saveclass writes Octave's binary format unless '-text' was given; the
+    // binary header is the same one Octave's own save uses
     octave_value tc;
     bool global = false;
-    std::string txt = read_text_data(file, filename, global, tc, 0);
-
-    octave_stdout << "Loaded class definition from file: " << txt << "\n";
+    std::string txt;
+
+    char magic[10];
+    if (file.read(magic, 10) && (std::memcmp(magic, "Octave-1-L", 10) == 0
+                                 || std::memcmp(magic, "Octave-1-B", 10) == 0)) {
+        char fmt_digit = 0;
+        file.read(&fmt_digit, 1);
+        octave::mach_info::float_format flt_fmt
+            = (fmt_digit == 1) ? octave::mach_info::flt_fmt_ieee_big_endian
+                               : octave::mach_info::flt_fmt_ieee_little_endian;
+        bool swap = (magic[9] == 'B') != octave::mach_info::words_big_endian();
+
+        std::string doc;
+        txt = read_binary_data(file, swap, flt_fmt, filename, global, tc, doc);
+    } else {
+        file.clear();
+        file.seekg(0);
+        txt = read_text_data(file, filename, global, tc, 0);
+    }
 
     if (!tc.isstruct()) {
         error("loadclass: loaded data is not a struct.");
     }
-    octave_scalar_map st = tc.scalar_map_value();
-
-    // Three options here:
-    // We can try to save everything to a struct, initialize the classdef object, and return it (problem: don't know how to return a classdef object in an octave_value)
-    // Or: We can reach into the interpreter and try to find an existing classdef object to populate
-    // Or: Just return a struct (the regular 'load' method already does this)
-    
-    // Just to see if the loading works
-    for (const auto& entry : st) {
-        // Print the property name and value
-        octave_stdout << "Property: " << entry.first << " has value: " 
-                      << st.contents(entry.second).string_value() << "\n";
-    }
 
-    octave_value_list val_list(1);
-    val_list(0) = st;
+    if (verbose) {
+        octave_stdout << "loadclass: read " << txt << " from " << filename
+                      << ", " << tc.dims().str() << " struct\n";
+        octave_map m = tc.map_value();
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            const Cell& vals = m.contents(it);
+            octave_stdout << "loadclass: " << m.key(it) << ": "
+                          << (vals.numel() == 1 ? vals(0).class_name() : "per element")
+                          << " " << (vals.numel() == 1 ? vals(0).dims() : vals.dims()).str() << "\n";
+        }
+    }
 
-    // Get the interpreter and load/save system
-    octave::interpreter* interp = octave::interpreter::the_interpreter();
-    octave::cdef_manager& cdef_mgr = interp->get_cdef_manager();
-    octave::cdef_class cls = cdef_mgr.find_class(filename);
+    const class_info& info = lookup_class(filename, "loadclass");
 
-    // For now, we assume the constructor takes in a struct
-    octave::cdef_object obj = cls.construct_object(val_list);
+    // A class with a static loadobj gets it called with a constructed object
+    // and the saved struct; any other object is allocated without running the
+    // constructor and the saved properties are assigned to it directly (see
+    // load_object in classcache.h).  A struct array, as saveclass writes for
+    // an object array, becomes an object array of the same shape.
+    if (info.loadobj.ok() && !info.loadobj.is_static()) {
+        error("loadclass: Class 'loadobj' method is not static.");
+    }
 
+    octave_map m = tc.map_value();
+    Array<octave::cdef_object> objs (m.dims());
+    for (octave_idx_type i = 0; i < m.numel(); i++) {
+        octave_value obj = load_object(info, m.checkelem(i));
+        if (!obj.is_classdef_object()) {
+            error("loadclass: loadobj did not return an object.");
+        }
+        objs(i) = octave::to_cdef(obj);
+    }
 
-    // How do I return the object in an octave_value? Beats me
     octave_value_list retval (nargout);
-    //octave_value val_obj = obj.get();
-    //retval(0) = obj; 
-    retval(0) = tc;
+    if (objs.numel() == 1) {
+        retval(0) = octave::to_ov(objs(0));
+    } else {
+        octave::cdef_object arr (new octave::cdef_object_array (objs));
+        arr.set_class(info.cls);
+        retval(0) = octave::to_ov(arr);
+    }
 
     return retval;
 }
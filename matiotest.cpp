@@ -3,337 +3,4965 @@
 #include "octave/ov-re-mat.h"
 
 #include <octave/cdef-manager.h>
+#include <octave/cdef-object.h>
 #include <octave/cdef-utils.h>
 #include <octave/interpreter.h>
 
 #include <octave/stack-frame.h>
 
 #include <matio.h>
+#if defined (MAT73) && MAT73
+#  include <hdf5.h>
+#endif
+
+#include "classcache.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <complex>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <mutex>
+#if defined (OCTAVE_HAVE_STD_PMR_POLYMORPHIC_ALLOCATOR)
+#  include <memory_resource>
+#endif
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined (__SSE4_2__)
+#  include <nmmintrin.h>
+#elif defined (__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#endif
+#if defined (__AVX2__)
+#  include <immintrin.h>
+#elif defined (__SSE2__)
+#  include <emmintrin.h>
+#endif
 
 // Globals
 octave::interpreter* interp = octave::interpreter::the_interpreter();
 octave::cdef_manager& cdef_mgr = interp->get_cdef_manager();
 octave::tree_evaluator& eval = interp->get_evaluator();
 
+// Serializes all matio calls.  HDF5 is usually built without thread safety,
+// and the async writer uses matio from its own thread.
+std::mutex matio_mutex;
+
+// Options passed to 'r' and 'w' as name/value pairs after the third argument
+struct io_options
+{
+    // Hand loadobj placeholders instead of reading the property data
+    bool lazy = false;
+
+    // File format and compression used by writeclass.  With auto_format the
+    // format is picked per save from the size of the data (see
+    // choose_format) and format is ignored.
+    bool auto_format = true;
+    mat_ft format = MAT_FT_MAT73;
+    matio_compression compression = MAT_COMPRESSION_NONE;
+
+    // Number of encoder threads, 0 for one per core
+    unsigned int threads = 0;
+
+    // Read the file back after writing it and check the checksums
+    bool verify = false;
+
+    // Write on the background thread (see async_writer)
+    bool async = false;
+
+    // Only rewrite the properties that changed since the last save of this
+    // file (see write_mat); implies v7.3
+    bool incremental = false;
+
+    // For 'append': bytes of chunks buffered per variable before they are
+    // written, and the (1-based) dimension to append along, 0 for the last
+    // dimension of the chunk
+    std::size_t memcap = 64 << 20;
+    int dim = 0;
+
+    // Append the object to a checkpoint log instead of writing a new file
+    // (see log_snapshot), and the (1-based) snapshot to read from one, 0 for
+    // the last
+    bool log = false;
+    octave_idx_type version = 0;
+};
+
+io_options parse_options(const octave_value_list& args, int first)
+{
+    io_options opts;
+    bool compression_set = false;
+
+    if ((args.length() - first) % 2 != 0) {
+        error("matiotest: options must be given as name/value pairs.");
+    }
+
+    for (int i = first; i < args.length(); i += 2) {
+        if (!args(i).is_string()) {
+            error("matiotest: option name must be a string.");
+        }
+        std::string name = args(i).string_value();
+        const octave_value& val = args(i+1);
+
+        if (name == "lazy") {
+            opts.lazy = val.bool_value();
+        } else if (name == "compression") {
+            // matio writes zlib at one fixed level, so there is no choice
+            // between fast and small to offer
+            std::string level = val.xstring_value("matiotest: 'compression' must be a string.");
+            if (level == "none") {
+                opts.compression = MAT_COMPRESSION_NONE;
+            } else if (level == "zlib") {
+                opts.compression = MAT_COMPRESSION_ZLIB;
+            } else if (level == "fast" || level == "max") {
+                error("matiotest: 'compression' levels are not supported by matio, use 'zlib'.");
+            } else {
+                error("matiotest: 'compression' must be 'none' or 'zlib'.");
+            }
+            compression_set = true;
+        } else if (name == "format") {
+            std::string fmt = val.xstring_value("matiotest: 'format' must be a string.");
+            opts.auto_format = (fmt == "auto");
+            if (fmt == "auto") {
+                // Resolved by write_mat
+            } else if (fmt == "v5") {
+                opts.format = MAT_FT_MAT5;
+            } else if (fmt == "v7") {
+                // v7 is the v5 layout with compressed variables
+                opts.format = MAT_FT_MAT5;
+                if (!compression_set) {
+                    opts.compression = MAT_COMPRESSION_ZLIB;
+                }
+            } else if (fmt == "v73") {
+                opts.format = MAT_FT_MAT73;
+            } else {
+                error("matiotest: 'format' must be 'auto', 'v5', 'v7' or 'v73'.");
+            }
+        } else if (name == "incremental") {
+            opts.incremental = val.bool_value();
+        } else if (name == "async") {
+            opts.async = val.bool_value();
+        } else if (name == "verify") {
+            opts.verify = val.bool_value();
+        } else if (name == "memcap") {
+            double memcap = val.xdouble_value("matiotest: 'memcap' must be a number.");
+            if (memcap < 0) {
+                error("matiotest: 'memcap' must be non-negative.");
+            }
+            opts.memcap = static_cast<std::size_t> (memcap);
+        } else if (name == "dim") {
+            opts.dim = val.xint_value("matiotest: 'dim' must be an integer.");
+            if (opts.dim < 1) {
+                error("matiotest: 'dim' must be positive.");
+            }
+        } else if (name == "log") {
+            opts.log = val.bool_value();
+        } else if (name == "version") {
+            opts.version = val.xidx_type_value("matiotest: 'version' must be an integer.");
+            if (opts.version < 1) {
+                error("matiotest: 'version' must be positive.");
+            }
+        } else if (name == "threads") {
+            int nthreads = val.xint_value("matiotest: 'threads' must be an integer.");
+            if (nthreads < 0) {
+                error("matiotest: 'threads' must be non-negative.");
+            }
+            opts.threads = nthreads;
+        } else {
+            error("matiotest: unknown option '%s'", name.c_str());
+        }
+    }
+
+    if (opts.incremental) {
+        opts.auto_format = false;
+        opts.format = MAT_FT_MAT73;
+    }
+
+    return opts;
+}
+
+
+// CRC-32C (Castagnoli) of a buffer.  Uses the SSE4.2 or ARMv8 CRC
+// instructions when the compiler targets them (e.g. -msse4.2 or
+// -march=native), and a lookup table otherwise.
+uint32_t crc32c(uint32_t crc, const void *buf, std::size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *> (buf);
+    crc = ~crc;
+
+#if defined (__SSE4_2__) || defined (__ARM_FEATURE_CRC32)
+    while (len >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+#  if defined (__SSE4_2__)
+        crc = static_cast<uint32_t> (_mm_crc32_u64 (crc, word));
+#  else
+        crc = __crc32cd (crc, word);
+#  endif
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+#  if defined (__SSE4_2__)
+        crc = _mm_crc32_u8 (crc, *p++);
+#  else
+        crc = __crc32cb (crc, *p++);
+#  endif
+    }
+#else
+    static const std::array<uint32_t, 256> table = [] () {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+            }
+            t[i] = c;
+        }
+        return t;
+    } ();
+
+    while (len-- > 0) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+#endif
+
+    return ~crc;
+}
+
+// Checksum of the data of a dense numeric, logical or char leaf, chained
+// onto crc.  The bytes are the ones Octave holds in memory, which are the
+// same after decoding, so the writer and the reader agree without
+// re-encoding anything.
+bool leaf_checksum(const octave_value& val, uint32_t& crc)
+{
+    // Ranges have no data buffer
+    octave_value full = val.is_range() ? octave_value (val.array_value()) : val;
+
+    const void *data = full.mex_get_data();
+    if (data == NULL && full.numel() > 0) {
+        return false;
+    }
+
+    crc = crc32c(crc, data, full.byte_size());
+    return true;
+}
 
+// The same for a sparse matrix: the column starts, then the row indices
+// and values of the nonzero elements
 template <typename T>
-Array<T> read_data(const matvar_t *matvar)
+uint32_t sparse_checksum(const Sparse<T>& sm, uint32_t crc)
+{
+    octave_idx_type nnz = sm.nnz();
+    crc = crc32c(crc, sm.cidx(), (sm.cols() + 1) * sizeof(octave_idx_type));
+    crc = crc32c(crc, sm.ridx(), nnz * sizeof(octave_idx_type));
+    return crc32c(crc, sm.data(), nnz * sizeof(T));
+}
+
+// Checksum of a property as it is written: a dense numeric, logical or char
+// array, a sparse matrix, or a struct or cell of those (classdef objects are
+// lowered to structs first, see lower_value).  Containers are walked with
+// an explicit stack.  Inside a container each node also contributes what it
+// is: a container its kind, size and (sorted) field names, a leaf its type
+// and dims, so moving data between elements or changing its type is caught.
+// Empty leaves only count as empty, since an empty string may come back from
+// the file as [].  A complex array whose imaginary parts are all zero comes
+// back real (octave_value narrows every complex array it is given), so it
+// is checksummed as that real array.  Returns false if the value holds anything else, e.g. a
+// function handle; such a property has no checksum at all.
+bool value_checksum(const octave_value& val, uint32_t& crc)
+{
+    struct node
+    {
+        char kind;
+        uint64_t n;
+    };
+
+    auto add_node = [&crc] (char kind, uint64_t n) {
+        node nd = {kind, n};
+        crc = crc32c(crc, &nd.kind, sizeof(nd.kind));
+        crc = crc32c(crc, &nd.n, sizeof(nd.n));
+    };
+
+    crc = 0;
+
+    // The top level value carries no node header, so a dense property has
+    // the plain checksum of its data
+    std::vector<std::pair<octave_value, bool>> stack;
+    stack.emplace_back(val, false);
+
+    while (!stack.empty()) {
+        octave_value v = std::move(stack.back().first);
+        bool nested = stack.back().second;
+        stack.pop_back();
+
+        if (v.iscomplex()) {
+            v.maybe_mutate();
+        }
+
+        if (v.iscell()) {
+            Cell c = v.cell_value();
+            add_node('C', c.numel());
+            for (octave_idx_type i = c.numel(); i-- > 0; ) {
+                stack.emplace_back(c(i), true);
+            }
+        } else if (v.isstruct()) {
+            octave_map m = v.map_value();
+            string_vector keys = m.keys();
+            keys.sort();
+            add_node('S', m.numel());
+            add_node('F', keys.numel());
+            for (octave_idx_type k = 0; k < keys.numel(); ++k) {
+                crc = crc32c(crc, keys(k).c_str(), keys(k).length() + 1);
+            }
+            // Element by element, the fields of each in sorted order
+            for (octave_idx_type i = m.numel(); i-- > 0; ) {
+                for (octave_idx_type k = keys.numel(); k-- > 0; ) {
+                    stack.emplace_back(m.contents(keys(k))(i), true);
+                }
+            }
+        } else if (v.issparse() || v.isnumeric() || v.islogical() || v.is_string()) {
+            if (nested) {
+                if (v.isempty()) {
+                    add_node('E', 0);
+                    continue;
+                }
+                dim_vector dv = v.dims();
+                add_node(v.issparse() ? 'P' : 'L', v.builtin_type());
+                for (int j = 0; j < dv.ndims(); ++j) {
+                    add_node('D', dv(j));
+                }
+            }
+
+            if (!v.issparse()) {
+                if (!leaf_checksum(v, crc)) {
+                    return false;
+                }
+            } else if (v.islogical()) {
+                crc = sparse_checksum<bool> (v.sparse_bool_matrix_value(), crc);
+            } else if (v.iscomplex()) {
+                crc = sparse_checksum<Complex> (v.sparse_complex_matrix_value(), crc);
+            } else {
+                crc = sparse_checksum<double> (v.sparse_matrix_value(), crc);
+            }
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Thrown by the decoding functions, which also run on worker threads where
+// error () can't be used.  The matiotest entry point reports it as an
+// Octave error.
+struct read_error : public std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// Closes a MAT file when it goes out of scope, so that an error thrown while
+// the file is open (read_error, or error () on the interpreter thread)
+// doesn't leak the mat_t and its HDF5 handles.  Converts to mat_t * for the
+// matio calls.
+class mat_file
+{
+public:
+    explicit mat_file(mat_t *matfp) : m_matfp (matfp) { }
+
+    mat_file(const mat_file&) = delete;
+    mat_file& operator = (const mat_file&) = delete;
+
+    ~mat_file()
+    {
+        if (m_matfp != NULL) {
+            Mat_Close(m_matfp);
+        }
+    }
+
+    operator mat_t * () const { return m_matfp; }
+
+    // Hands the file to an owner that outlives this scope
+    mat_t *release()
+    {
+        mat_t *matfp = m_matfp;
+        m_matfp = NULL;
+        return matfp;
+    }
+
+private:
+    mat_t *m_matfp;
+};
+
+// The same for a variable header from Mat_VarReadInfo
+struct matvar_deleter
+{
+    void operator()(matvar_t *matvar) const { Mat_VarFree(matvar); }
+};
+
+typedef std::unique_ptr<matvar_t, matvar_deleter> matvar_ptr;
+
+// How much matiotest prints, set with matiotest ('verbose', n).  0 prints
+// nothing, 1 a line per save or load, 2 also a line per variable and 3 also
+// matio's dump of every variable.  Only the interpreter thread prints, except
+// for the level 3 dumps.
+std::atomic<int> verbosity (0);
+
+// Counters behind matiotest ('stats').  They are updated from the writer and
+// decoding threads as well, so they are atomic.  Times are summed over
+// threads and phases nest (raise includes the loadobj calls it makes, read
+// includes decode), so they can add up to more than the wall time.
+struct io_stats
+{
+    enum phase { lookup, saveobj, lower, encode, write, read, decode, raise, loadobj, nphases };
+
+    std::array<std::atomic<uint64_t>, nphases> ns {};
+    std::array<std::atomic<uint64_t>, nphases> calls {};
+
+    std::atomic<uint64_t> vars_written {0};
+    std::atomic<uint64_t> vars_read {0};
+    std::atomic<uint64_t> bytes_written {0};
+    std::atomic<uint64_t> bytes_read {0};
+
+    // Buffers from alloc_array
+    std::atomic<uint64_t> allocs {0};
+    std::atomic<uint64_t> alloc_bytes {0};
+
+    // In-memory bytes of each top-level variable (property) written or read,
+    // keyed by name
+    std::mutex mtx;
+    std::map<std::string, uint64_t> property_bytes;
+
+    void add_variable(const std::string& name, uint64_t bytes, bool written)
+    {
+        (written ? vars_written : vars_read) += 1;
+        (written ? bytes_written : bytes_read) += bytes;
+
+        std::lock_guard<std::mutex> lock (mtx);
+        property_bytes[name] += bytes;
+    }
+
+    void reset()
+    {
+        for (int p = 0; p < nphases; ++p) {
+            ns[p] = 0;
+            calls[p] = 0;
+        }
+        vars_written = 0;
+        vars_read = 0;
+        bytes_written = 0;
+        bytes_read = 0;
+        allocs = 0;
+        alloc_bytes = 0;
+
+        std::lock_guard<std::mutex> lock (mtx);
+        property_bytes.clear();
+    }
+
+    octave_scalar_map to_map()
+    {
+        static const char *names[nphases]
+            = { "lookup", "saveobj", "lower", "encode", "write", "read", "decode", "raise", "loadobj" };
+
+        octave_scalar_map time, count;
+        for (int p = 0; p < nphases; ++p) {
+            time.setfield(names[p], static_cast<double> (ns[p]) * 1e-9);
+            count.setfield(names[p], static_cast<double> (calls[p]));
+        }
+
+        octave_scalar_map props;
+        {
+            std::lock_guard<std::mutex> lock (mtx);
+            for (const auto& entry : property_bytes) {
+                props.setfield(entry.first, static_cast<double> (entry.second));
+            }
+        }
+
+        octave_scalar_map st;
+        st.setfield("time", time);
+        st.setfield("calls", count);
+        st.setfield("vars_written", static_cast<double> (vars_written));
+        st.setfield("vars_read", static_cast<double> (vars_read));
+        st.setfield("bytes_written", static_cast<double> (bytes_written));
+        st.setfield("bytes_read", static_cast<double> (bytes_read));
+        st.setfield("allocs", static_cast<double> (allocs));
+        st.setfield("alloc_bytes", static_cast<double> (alloc_bytes));
+        st.setfield("property_bytes", props);
+        return st;
+    }
+};
+
+io_stats stats;
+
+// Adds the time until it goes out of scope to a phase
+class phase_timer
+{
+public:
+    explicit phase_timer(io_stats::phase p)
+        : m_phase (p), m_start (std::chrono::steady_clock::now())
+    { }
+
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+
+    ~phase_timer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        stats.ns[m_phase] += std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count();
+        stats.calls[m_phase] += 1;
+    }
+
+private:
+    io_stats::phase m_phase;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Translate the matio dimensions of a variable into an Octave dim_vector
+dim_vector mat_dims(const matvar_t *matvar)
 {
     dim_vector dv;
-    dv.alloc (matvar->rank);
+    dv.resize (matvar->rank < 2 ? 2 : matvar->rank, 1);
     for (int i = 0; i < matvar->rank; ++i) {
-        dv(i) = matvar->dims[i];  
+        dv(i) = matvar->dims[i];
     }
 
-    // data will be freed by Array destructor
-    T *data = new T[matvar->nbytes / matvar->data_size];
-    octave_stdout << "Reading data of size: " << matvar->nbytes << " bytes, with data size: " << matvar->data_size << " bytes.\n";
-    std::memcpy(data, matvar->data, matvar->nbytes);
+    return dv;
+}
 
-    Array<T> a (data, dv); 
-    return std::move(a);
+#if defined (OCTAVE_HAVE_STD_PMR_POLYMORPHIC_ALLOCATOR)
+// Optional pool for the arrays that loading allocates, enabled with
+// matiotest ('pool', 'on').  Loading many checkpoints of the same shape
+// allocates the same sizes over and over; a freed buffer is kept on a free
+// list keyed by its size and alignment (so by element type and count) and
+// handed to the next array of that size, instead of going back to the
+// system and being faulted in again.  Arrays remember the pool through
+// their allocator, so buffers return here from whichever thread drops the
+// last reference, after the load is long over.
+class buffer_pool : public std::pmr::memory_resource
+{
+public:
+    buffer_pool() = default;
+
+    buffer_pool(const buffer_pool&) = delete;
+    buffer_pool& operator = (const buffer_pool&) = delete;
+
+    bool enabled() const { return m_enabled; }
+
+    // Freed buffers beyond capacity bytes of cached ones are released
+    void enable(std::size_t capacity)
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+        m_capacity = capacity;
+        m_enabled = true;
+    }
+
+    void disable()
+    {
+        m_enabled = false;
+        trim();
+    }
+
+    // Release all cached buffers
+    void trim()
+    {
+        std::map<key, std::vector<void *>> free;
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            free.swap(m_free);
+            m_cached = 0;
+        }
+
+        std::pmr::memory_resource *up = std::pmr::new_delete_resource();
+        for (const auto& kv : free) {
+            for (void *p : kv.second) {
+                up->deallocate(p, kv.first.first, kv.first.second);
+            }
+        }
+    }
+
+    octave_scalar_map stats()
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+
+        std::size_t buffers = 0;
+        for (const auto& kv : m_free) {
+            buffers += kv.second.size();
+        }
+
+        octave_scalar_map st;
+        st.setfield("enabled", m_enabled.load());
+        st.setfield("capacity", static_cast<double> (m_capacity));
+        st.setfield("cached_bytes", static_cast<double> (m_cached));
+        st.setfield("cached_buffers", static_cast<double> (buffers));
+        st.setfield("size_classes", static_cast<double> (m_free.size()));
+        st.setfield("live_buffers", static_cast<double> (m_live));
+        st.setfield("hits", static_cast<double> (m_hits));
+        st.setfield("misses", static_cast<double> (m_misses));
+        return st;
+    }
+
+protected:
+    void * do_allocate(std::size_t bytes, std::size_t align) override
+    {
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            ++m_live;
+            auto it = m_free.find(key (bytes, align));
+            if (it != m_free.end() && !it->second.empty()) {
+                void *p = it->second.back();
+                it->second.pop_back();
+                m_cached -= bytes;
+                ++m_hits;
+                return p;
+            }
+            ++m_misses;
+        }
+
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t align) override
+    {
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            --m_live;
+            if (m_enabled && bytes > 0 && m_cached + bytes <= m_capacity) {
+                m_free[key (bytes, align)].push_back(p);
+                m_cached += bytes;
+                return;
+            }
+        }
+
+        std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    // Size and alignment in bytes
+    typedef std::pair<std::size_t, std::size_t> key;
+
+    std::atomic<bool> m_enabled {false};
+
+    std::mutex m_mutex;
+    std::map<key, std::vector<void *>> m_free;
+    std::size_t m_capacity = 0;
+    std::size_t m_cached = 0;
+    std::size_t m_live = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
+
+// Never destroyed, like the class cache: arrays from the pool can outlive
+// this module's static destructors
+buffer_pool& decode_pool()
+{
+    static buffer_pool *pool = new buffer_pool ();
+    return *pool;
 }
+#endif
 
-// Since we have many types we could possibly return here, we'll just instead pass the struct as a parameter to be filled
-void get_var(const matvar_t *matvar, octave_scalar_map& st)
+// Allocate Octave-owned storage for a variable that is about to be filled in
+// by matio.  The elements are left uninitialized, since Array<T> (dv) would
+// otherwise make a full pass over the buffer just to zero it.
+template <typename T>
+Array<T> alloc_array(const dim_vector& dv)
 {
-    switch (matvar->class_type) {
-        case MAT_C_DOUBLE: {
-            Array<double> a = read_data<double>(matvar);
-            NDArray var (a);
-            st.assign(matvar->name, var);
-            break;
+    octave_idx_type n = dv.safe_numel ();
+
+    stats.allocs += 1;
+    stats.alloc_bytes += n * sizeof (T);
+
+#if defined (OCTAVE_HAVE_STD_PMR_POLYMORPHIC_ALLOCATOR)
+    buffer_pool& pool = decode_pool();
+    std::pmr::polymorphic_allocator<T> alloc (pool.enabled() ? &pool : std::pmr::get_default_resource());
+    T *data = alloc.allocate (n);
+    return Array<T> (data, dv, alloc);
+#else
+    // data will be freed by Array destructor
+    T *data = new T[n];
+    return Array<T> (data, dv);
+#endif
+}
+
+// A block of a variable in matio's terms: zero-based start, stride and
+// number of elements along each dimension
+struct hyperslab
+{
+    std::vector<int> start;
+    std::vector<int> stride;
+    std::vector<int> edge;
+
+    dim_vector dims() const
+    {
+        dim_vector dv;
+        dv.resize (edge.size() < 2 ? 2 : edge.size(), 1);
+        for (std::size_t i = 0; i < edge.size(); ++i) {
+            dv(i) = edge[i];
         }
-        case MAT_C_SINGLE: {
-            octave_stdout << "SINGLE\n";
-            octave_stdout << "Variable " << matvar->name << " is of type single.\n";
-            break;
+        return dv;
+    }
+};
+
+// matio takes the start, stride and edge of a hyperslab as int, so a
+// variable with a dimension of 2^31 elements or more can't be read by block
+hyperslab full_hyperslab(const matvar_t *matvar)
+{
+    hyperslab hs;
+    hs.start.assign (matvar->rank, 0);
+    hs.stride.assign (matvar->rank, 1);
+    hs.edge.resize (matvar->rank);
+    for (int i = 0; i < matvar->rank; ++i) {
+        if (matvar->dims[i] > static_cast<std::size_t> (std::numeric_limits<int>::max ())) {
+            throw read_error (std::string ("matiotest: dimension ") + std::to_string (i+1)
+                              + " of variable '" + matvar->name + "' is too large to read");
         }
+        hs.edge[i] = static_cast<int> (matvar->dims[i]);
+    }
+
+    return hs;
+}
+
+// Read (a block of) a numeric variable straight into Octave storage.  matvar
+// must come from Mat_VarReadNextInfo / Mat_VarReadInfo, so matio has not read
+// the data yet; Mat_VarReadData converts to the class type while it reads, so
+// the payload is only ever held once.
+template <typename T>
+Array<T> read_array(mat_t *matfp, matvar_t *matvar, const hyperslab& hs)
+{
+    Array<T> a = alloc_array<T> (hs.dims ());
+    if (a.isempty ()) {
+        return a;
+    }
+
+    if (Mat_VarReadData (matfp, matvar, a.fortran_vec (),
+                         const_cast<int *> (hs.start.data ()),
+                         const_cast<int *> (hs.stride.data ()),
+                         const_cast<int *> (hs.edge.data ())) != 0) {
+        throw read_error (std::string ("matiotest: could not read data for variable '")
+                          + matvar->name + "'");
+    }
+
+    return a;
+}
+
+// Complex data is stored split (all real parts, then all imaginary parts) in
+// MAT files, while Octave interleaves them.  The real parts are read into the
+// upper half of the result buffer and only the imaginary parts need a scratch
+// buffer; interleaving then runs front to back, which never overwrites a real
+// part before it has been moved.  Peak memory is 1.5x the payload, not 2x.
+template <typename T>
+Array<std::complex<T>> read_complex_array(mat_t *matfp, matvar_t *matvar, const hyperslab& hs)
+{
+    Array<std::complex<T>> a = alloc_array<std::complex<T>> (hs.dims ());
+    octave_idx_type n = a.numel ();
+    if (n == 0) {
+        return a;
+    }
+
+    T *buf = reinterpret_cast<T *> (a.fortran_vec ());
+    std::unique_ptr<T[]> im (new T[n]);
+
+    mat_complex_split_t split;
+    split.Re = buf + n;
+    split.Im = im.get ();
+
+    if (Mat_VarReadData (matfp, matvar, &split,
+                         const_cast<int *> (hs.start.data ()),
+                         const_cast<int *> (hs.stride.data ()),
+                         const_cast<int *> (hs.edge.data ())) != 0) {
+        throw read_error (std::string ("matiotest: could not read data for variable '")
+                          + matvar->name + "'");
+    }
+
+    for (octave_idx_type i = 0; i < n; ++i) {
+        T re = buf[n + i];
+        buf[2*i] = re;
+        buf[2*i + 1] = im[i];
+    }
+
+    return a;
+}
+
+// Decode a block of a numeric variable.  Returns an undefined value, without
+// reading, for classes that can't be read through Mat_VarReadData and for
+// complex integers: matio would take the buffer for a mat_complex_split_t.
+octave_value read_block(mat_t *matfp, matvar_t *matvar, const hyperslab& hs)
+{
+    bool cplx = matvar->isComplex;
+
+    switch (matvar->class_type) {
+        case MAT_C_DOUBLE:
+            if (cplx)
+                return ComplexNDArray (read_complex_array<double> (matfp, matvar, hs));
+            return NDArray (read_array<double> (matfp, matvar, hs));
+        case MAT_C_SINGLE:
+            if (cplx)
+                return FloatComplexNDArray (read_complex_array<float> (matfp, matvar, hs));
+            return FloatNDArray (read_array<float> (matfp, matvar, hs));
         case MAT_C_INT8:
-            octave_stdout << "INT8\n";
-            octave_stdout << "Variable " << matvar->name << " is of type int8.\n";
-            break;
+            return cplx ? octave_value () : int8NDArray (read_array<octave_int8> (matfp, matvar, hs));
         case MAT_C_UINT8:
-            octave_stdout << "UINT8\n";
-            octave_stdout << "Variable " << matvar->name << " is of type uint8.\n";
-            break;
+            if (cplx)
+                return octave_value ();
+            // Logicals are stored as uint8 with the logical flag set; bool is
+            // one byte wide, so they are read into boolNDArray storage directly
+            if (matvar->isLogical)
+                return boolNDArray (read_array<bool> (matfp, matvar, hs));
+            return uint8NDArray (read_array<octave_uint8> (matfp, matvar, hs));
         case MAT_C_INT16:
-            octave_stdout << "INT16\n";
-            octave_stdout << "Variable " << matvar->name << " is of type int16.\n";
-            break;
+            return cplx ? octave_value () : int16NDArray (read_array<octave_int16> (matfp, matvar, hs));
         case MAT_C_UINT16:
-            octave_stdout << "UINT16\n";
-            octave_stdout << "Variable " << matvar->name << " is of type uint16.\n";
-            break;
+            return cplx ? octave_value () : uint16NDArray (read_array<octave_uint16> (matfp, matvar, hs));
         case MAT_C_INT32:
-            octave_stdout << "INT32\n";
-            octave_stdout << "Variable " << matvar->name << " is of type int32.\n";
-            break;
+            return cplx ? octave_value () : int32NDArray (read_array<octave_int32> (matfp, matvar, hs));
         case MAT_C_UINT32:
-            octave_stdout << "UINT32\n";
-            octave_stdout << "Variable " << matvar->name << " is of type uint32.\n";
-            break;
+            return cplx ? octave_value () : uint32NDArray (read_array<octave_uint32> (matfp, matvar, hs));
         case MAT_C_INT64:
-            octave_stdout << "INT64\n";
-            octave_stdout << "Variable " << matvar->name << " is of type int64.\n";
-            break;
+            return cplx ? octave_value () : int64NDArray (read_array<octave_int64> (matfp, matvar, hs));
         case MAT_C_UINT64:
-            octave_stdout << "UINT64\n";
-            octave_stdout << "Variable " << matvar->name << " is of type uint64.\n";
+            return cplx ? octave_value () : uint64NDArray (read_array<octave_uint64> (matfp, matvar, hs));
+        default:
+            return octave_value ();
+    }
+}
+
+// Text.  Octave holds char arrays as bytes (UTF-8), while MATLAB stores
+// char data as UTF-16 code units.  For ASCII both are the same numbers at
+// different widths, so the loops below widen or narrow 32 (AVX2) or 16
+// (SSE2) characters at a time and only drop to per-character UTF-8 coding
+// from the first non-ASCII character on.
+
+// Widen the leading ASCII bytes of src to UTF-16.  Returns how many were
+// converted: n, or the position of the first non-ASCII byte.
+std::size_t widen_ascii(const char *src, std::size_t n, uint16_t *dst)
+{
+    std::size_t i = 0;
+
+#if defined (__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src + i));
+        if (_mm256_movemask_epi8 (v) != 0) {
+            break;
+        }
+        __m256i lo = _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (v));
+        __m256i hi = _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (v, 1));
+        _mm256_storeu_si256 (reinterpret_cast<__m256i *> (dst + i), lo);
+        _mm256_storeu_si256 (reinterpret_cast<__m256i *> (dst + i + 16), hi);
+    }
+#endif
+#if defined (__SSE2__)
+    const __m128i zero = _mm_setzero_si128 ();
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src + i));
+        if (_mm_movemask_epi8 (v) != 0) {
+            break;
+        }
+        _mm_storeu_si128 (reinterpret_cast<__m128i *> (dst + i), _mm_unpacklo_epi8 (v, zero));
+        _mm_storeu_si128 (reinterpret_cast<__m128i *> (dst + i + 8), _mm_unpackhi_epi8 (v, zero));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        unsigned char c = src[i];
+        if (c >= 0x80) {
+            break;
+        }
+        dst[i] = c;
+    }
+
+    return i;
+}
+
+// Narrow the leading ASCII code units of src to chars, the reverse of
+// widen_ascii
+std::size_t narrow_ascii(const uint16_t *src, std::size_t n, char *dst)
+{
+    std::size_t i = 0;
+
+#if defined (__AVX2__)
+    const __m256i high = _mm256_set1_epi16 (static_cast<short> (0xFF80));
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src + i));
+        __m256i b = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src + i + 16));
+        if (!_mm256_testz_si256 (_mm256_or_si256 (a, b), high)) {
+            break;
+        }
+        // packus works within 128 bit lanes, so the quarters come out as
+        // a0 b0 a1 b1 and are put back in order
+        __m256i packed = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, b), 0xD8);
+        _mm256_storeu_si256 (reinterpret_cast<__m256i *> (dst + i), packed);
+    }
+#endif
+#if defined (__SSE2__)
+    const __m128i mask = _mm_set1_epi16 (static_cast<short> (0xFF80));
+    const __m128i zero = _mm_setzero_si128 ();
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src + i));
+        __m128i b = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src + i + 8));
+        __m128i bits = _mm_and_si128 (_mm_or_si128 (a, b), mask);
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (bits, zero)) != 0xFFFF) {
             break;
-        case MAT_C_CHAR: {
-            octave_stdout << "CHAR\n";
-            charNDArray a (read_data<char>(matvar));
-            st.assign(matvar->name, a);
+        }
+        _mm_storeu_si128 (reinterpret_cast<__m128i *> (dst + i), _mm_packus_epi16 (a, b));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (src[i] >= 0x80) {
             break;
         }
-        case MAT_C_CELL:
-            octave_stdout << "CELL\n";
-            octave_stdout << "Variable " << matvar->name << " is a cell array.\n";
-            break;
-        case MAT_C_STRUCT: {
-            octave_stdout << "STRUCT\n";
-            // Get the number of fields in the struct
-            //unsigned int num_fields = Mat_VarGetNumberOfFields(matvar);
-            //matvar_t *fields = Mat_VarGetStructsLinear(matvar, 0, 1, num_fields, 0);
+        dst[i] = static_cast<char> (src[i]);
+    }
+
+    return i;
+}
+
+// UTF-32 text is rare enough not to need a vector loop
+std::size_t narrow_ascii(const uint32_t *src, std::size_t n, char *dst)
+{
+    std::size_t i = 0;
+    for (; i < n && src[i] < 0x80; ++i) {
+        dst[i] = static_cast<char> (src[i]);
+    }
+
+    return i;
+}
+
+void append_utf8(std::string& s, uint32_t cp)
+{
+    if (cp < 0x80) {
+        s += static_cast<char> (cp);
+    } else if (cp < 0x800) {
+        s += static_cast<char> (0xC0 | (cp >> 6));
+        s += static_cast<char> (0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        s += static_cast<char> (0xE0 | (cp >> 12));
+        s += static_cast<char> (0x80 | ((cp >> 6) & 0x3F));
+        s += static_cast<char> (0x80 | (cp & 0x3F));
+    } else {
+        s += static_cast<char> (0xF0 | (cp >> 18));
+        s += static_cast<char> (0x80 | ((cp >> 12) & 0x3F));
+        s += static_cast<char> (0x80 | ((cp >> 6) & 0x3F));
+        s += static_cast<char> (0x80 | (cp & 0x3F));
+    }
+}
+
+// Decode the UTF-8 sequence at src[i], advancing i.  Returns false for
+// malformed, overlong and surrogate sequences.
+bool next_utf8(const char *src, std::size_t n, std::size_t& i, uint32_t& cp)
+{
+    unsigned char c = src[i];
+    int len;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (c < 0x80) {
+        cp = c;
+        ++i;
+        return true;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+        cp = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        cp = c & 0x0F;
+        lo = (c == 0xE0) ? 0xA0 : 0x80;
+        hi = (c == 0xED) ? 0x9F : 0xBF;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        cp = c & 0x07;
+        lo = (c == 0xF0) ? 0x90 : 0x80;
+        hi = (c == 0xF4) ? 0x8F : 0xBF;
+    } else {
+        return false;
+    }
+
+    if (i + len > n) {
+        return false;
+    }
+    for (int k = 1; k < len; ++k) {
+        unsigned char cc = src[i + k];
+        if (cc < lo || cc > hi) {
+            return false;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+        cp = (cp << 6) | (cc & 0x3F);
+    }
+
+    i += len;
+    return true;
+}
+
+// Whether text of size dv can change length when it is transcoded: only a
+// single row can, since everything else has to keep its shape
+bool is_text_row(const dim_vector& dv)
+{
+    return dv.ndims() == 2 && dv(0) == 1;
+}
+
+// Convert n chars to UTF-16.  Text that isn't ASCII is only converted if
+// row is true and it is valid UTF-8.  Returns false if it isn't converted.
+bool to_utf16(const char *src, std::size_t n, bool row, std::vector<uint16_t>& dst)
+{
+    dst.resize(n);
+    std::size_t i = widen_ascii(src, n, dst.data());
+    if (i == n) {
+        return true;
+    }
+    if (!row) {
+        return false;
+    }
+
+    // Every code unit comes from at least one byte, so dst is big enough
+    std::size_t k = i;
+    while (i < n) {
+        std::size_t m = widen_ascii(src + i, n - i, dst.data() + k);
+        i += m;
+        k += m;
+        if (i == n) {
+            break;
+        }
+
+        uint32_t cp;
+        if (!next_utf8(src, n, i, cp)) {
+            return false;
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            dst[k++] = static_cast<uint16_t> (0xD800 + (cp >> 10));
+            dst[k++] = static_cast<uint16_t> (0xDC00 + (cp & 0x3FF));
+        } else {
+            dst[k++] = static_cast<uint16_t> (cp);
+        }
+    }
+    dst.resize(k);
+
+    return true;
+}
+
+// Decode text stored as UTF-16 (U = uint16_t) or UTF-32 code units.  A row
+// becomes UTF-8 and may get longer; anything else keeps its shape, so its
+// non-ASCII characters are replaced with '?'.  So are unpaired surrogates.
+template <typename U>
+charNDArray decode_units(const U *src, const dim_vector& dv)
+{
+    std::size_t n = dv.numel();
+    Array<char> a = alloc_array<char> (dv);
+    char *dst = a.fortran_vec();
+
+    std::size_t i = narrow_ascii(src, n, dst);
+    if (i == n) {
+        return charNDArray (a);
+    }
+
+    if (!is_text_row(dv)) {
+        for (; i < n; ++i) {
+            dst[i] = (src[i] < 0x80) ? static_cast<char> (src[i]) : '?';
+        }
+        return charNDArray (a);
+    }
+
+    std::string s (dst, i);
+    while (i < n) {
+        uint32_t cp = src[i++];
+        if (sizeof (U) == 2 && cp >= 0xD800 && cp <= 0xDBFF
+            && i < n && src[i] >= 0xDC00 && src[i] <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (src[i++] - 0xDC00);
+        } else if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+            cp = '?';
+        }
+        append_utf8(s, cp);
+    }
+
+    return charNDArray (s);
+}
+
+// Decode a char variable that was read with Mat_VarRead, by the width of
+// its stored code units.  One byte units are UTF-8 and copied as they are;
+// their count may differ from the number of characters in the header.
+octave_value decode_char(const matvar_t *matvar)
+{
+    dim_vector dv = mat_dims(matvar);
+    std::size_t n = dv.numel();
+    if (n == 0) {
+        return charNDArray (dv);
+    }
+    if (matvar->data == NULL || matvar->data_size <= 0
+        || matvar->nbytes / matvar->data_size < n) {
+        return octave_value ();
+    }
+
+    switch (matvar->data_size) {
+        case 1:
+        {
+            const char *src = static_cast<const char *> (matvar->data);
+            if (matvar->nbytes != n && is_text_row(dv)) {
+                return charNDArray (std::string (src, matvar->nbytes));
+            }
+            Array<char> a = alloc_array<char> (dv);
+            std::memcpy(a.fortran_vec(), src, n);
+            return charNDArray (a);
+        }
+        case 2:
+            return decode_units(static_cast<const uint16_t *> (matvar->data), dv);
+        case 4:
+            return decode_units(static_cast<const uint32_t *> (matvar->data), dv);
+        default:
+            return octave_value ();
+    }
+}
+
+// Copy a leaf that matio has already read into memory (the elements of
+// structs and cells come from a full Mat_VarRead).  Returns false if matio
+// holds the data in a different element type.
+template <typename T>
+bool copy_array(const matvar_t *matvar, Array<T>& a)
+{
+    a = alloc_array<T> (mat_dims (matvar));
+    if (a.isempty ()) {
+        return true;
+    }
+    if (matvar->data == NULL || matvar->data_size != sizeof (T)) {
+        return false;
+    }
+
+    std::memcpy (a.fortran_vec (), matvar->data, a.numel () * sizeof (T));
+    return true;
+}
+
+template <typename T>
+bool copy_complex_array(const matvar_t *matvar, Array<std::complex<T>>& a)
+{
+    a = alloc_array<std::complex<T>> (mat_dims (matvar));
+    octave_idx_type n = a.numel ();
+    if (n == 0) {
+        return true;
+    }
+    if (matvar->data == NULL || matvar->data_size != sizeof (T)) {
+        return false;
+    }
+
+    const mat_complex_split_t *split = static_cast<const mat_complex_split_t *> (matvar->data);
+    const T *re = static_cast<const T *> (split->Re);
+    const T *im = static_cast<const T *> (split->Im);
+    std::complex<T> *dst = a.fortran_vec ();
+    for (octave_idx_type i = 0; i < n; ++i) {
+        dst[i] = std::complex<T> (re[i], im[i]);
+    }
+
+    return true;
+}
+
+template <typename ArrayT>
+octave_value copy_leaf(const matvar_t *matvar)
+{
+    Array<typename ArrayT::element_type> a;
+    return copy_array (matvar, a) ? octave_value (ArrayT (a)) : octave_value ();
+}
+
+template <typename ArrayT>
+octave_value copy_complex_leaf(const matvar_t *matvar)
+{
+    Array<typename ArrayT::element_type> a;
+    return copy_complex_array (matvar, a) ? octave_value (ArrayT (a)) : octave_value ();
+}
+
+// Copy n elements stored as S into dst
+template <typename S, typename T>
+void convert_as(const void *src, octave_idx_type n, T *dst)
+{
+    const S *s = static_cast<const S *> (src);
+    for (octave_idx_type i = 0; i < n; ++i) {
+        dst[i] = static_cast<T> (s[i]);
+    }
+}
+
+// Convert n elements of matio data type type to T.  Returns false for
+// types that aren't numeric.
+template <typename T>
+bool convert_values(const void *src, matio_types type, octave_idx_type n, T *dst)
+{
+    if (n == 0) {
+        return true;
+    }
+    if (src == NULL) {
+        return false;
+    }
+
+    switch (type) {
+        case MAT_T_DOUBLE: convert_as<double> (src, n, dst); return true;
+        case MAT_T_SINGLE: convert_as<float> (src, n, dst); return true;
+        case MAT_T_INT8: convert_as<int8_t> (src, n, dst); return true;
+        case MAT_T_UINT8: convert_as<uint8_t> (src, n, dst); return true;
+        case MAT_T_INT16: convert_as<int16_t> (src, n, dst); return true;
+        case MAT_T_UINT16: convert_as<uint16_t> (src, n, dst); return true;
+        case MAT_T_INT32: convert_as<int32_t> (src, n, dst); return true;
+        case MAT_T_UINT32: convert_as<uint32_t> (src, n, dst); return true;
+        case MAT_T_INT64: convert_as<int64_t> (src, n, dst); return true;
+        case MAT_T_UINT64: convert_as<uint64_t> (src, n, dst); return true;
+        default: return false;
+    }
+}
+
+// Fill in the compressed column indices of s from matio's.  s has
+// already been sized for nnz elements.
+template <typename SparseT>
+void copy_sparse_indices(SparseT& s, const mat_sparse_t *sparse, octave_idx_type nnz)
+{
+    octave_idx_type *ridx = s.ridx();
+    for (octave_idx_type i = 0; i < nnz; ++i) {
+        ridx[i] = sparse->ir[i];
+    }
+
+    octave_idx_type *cidx = s.cidx();
+    for (octave_idx_type j = 0; j <= s.cols(); ++j) {
+        cidx[j] = sparse->jc[j];
+    }
+}
+
+// Decode a sparse matrix that was read with Mat_VarRead.  The compressed
+// column arrays map one to one onto Octave's sparse storage, so the matrix
+// is built directly, never as a dense intermediate; only matio's 32 bit
+// indices are widened.
+octave_value decode_sparse(const matvar_t *matvar)
+{
+    const mat_sparse_t *sparse = static_cast<const mat_sparse_t *> (matvar->data);
+    if (sparse == NULL || matvar->rank != 2) {
+        return octave_value ();
+    }
+
+    octave_idx_type nr = matvar->dims[0];
+    octave_idx_type nc = matvar->dims[1];
+    if (sparse->jc == NULL || static_cast<octave_idx_type> (sparse->njc) < nc + 1) {
+        return octave_value ();
+    }
+
+    octave_idx_type nnz = sparse->jc[nc];
+    if (nnz > static_cast<octave_idx_type> (sparse->nir)
+        || nnz > static_cast<octave_idx_type> (sparse->ndata)) {
+        return octave_value ();
+    }
+
+    if (matvar->isLogical) {
+        SparseBoolMatrix s (nr, nc, nnz);
+        copy_sparse_indices(s, sparse, nnz);
+        if (!convert_values(sparse->data, matvar->data_type, nnz, s.data())) {
+            return octave_value ();
+        }
+        return s;
+    }
+
+    if (matvar->isComplex) {
+        SparseComplexMatrix s (nr, nc, nnz);
+        copy_sparse_indices(s, sparse, nnz);
+        const mat_complex_split_t *split = static_cast<const mat_complex_split_t *> (sparse->data);
+        std::vector<double> re (nnz), im (nnz);
+        if (nnz > 0 && (split == NULL
+                        || !convert_values(split->Re, matvar->data_type, nnz, re.data())
+                        || !convert_values(split->Im, matvar->data_type, nnz, im.data()))) {
+            return octave_value ();
+        }
+        Complex *data = s.data();
+        for (octave_idx_type i = 0; i < nnz; ++i) {
+            data[i] = Complex (re[i], im[i]);
+        }
+        return s;
+    }
+
+    SparseMatrix s (nr, nc, nnz);
+    copy_sparse_indices(s, sparse, nnz);
+    if (!convert_values(sparse->data, matvar->data_type, nnz, s.data())) {
+        return octave_value ();
+    }
+    return s;
+}
+
+// Decode an array inside a struct or cell.  Returns an undefined value for
+// classes that aren't supported.
+octave_value decode_leaf(const matvar_t *matvar)
+{
+    bool cplx = matvar->isComplex;
+
+    switch (matvar->class_type) {
+        case MAT_C_DOUBLE:
+            if (cplx)
+                return copy_complex_leaf<ComplexNDArray> (matvar);
+            return copy_leaf<NDArray> (matvar);
+        case MAT_C_SINGLE:
+            if (cplx)
+                return copy_complex_leaf<FloatComplexNDArray> (matvar);
+            return copy_leaf<FloatNDArray> (matvar);
+        case MAT_C_INT8:
+            return cplx ? octave_value () : copy_leaf<int8NDArray> (matvar);
+        case MAT_C_UINT8:
+            if (cplx)
+                return octave_value ();
+            if (matvar->isLogical)
+                return copy_leaf<boolNDArray> (matvar);
+            return copy_leaf<uint8NDArray> (matvar);
+        case MAT_C_INT16:
+            return cplx ? octave_value () : copy_leaf<int16NDArray> (matvar);
+        case MAT_C_UINT16:
+            return cplx ? octave_value () : copy_leaf<uint16NDArray> (matvar);
+        case MAT_C_INT32:
+            return cplx ? octave_value () : copy_leaf<int32NDArray> (matvar);
+        case MAT_C_UINT32:
+            return cplx ? octave_value () : copy_leaf<uint32NDArray> (matvar);
+        case MAT_C_INT64:
+            return cplx ? octave_value () : copy_leaf<int64NDArray> (matvar);
+        case MAT_C_UINT64:
+            return cplx ? octave_value () : copy_leaf<uint64NDArray> (matvar);
+        case MAT_C_CHAR:
+            return decode_char (matvar);
+        case MAT_C_SPARSE:
+            return decode_sparse (matvar);
+        default:
+            return octave_value ();
+    }
+}
+
+// Convert a struct or cell that was read with Mat_VarRead.  The tree is
+// walked with an explicit stack, the mirror image of write_var: each
+// container is assembled once all of its children are decoded.  Mat_VarRead
+// itself recurses per level, though, so a file from elsewhere nested far
+// deeper than max_nesting_depth can still exhaust the C stack there.  Elements
+// that can't be decoded become [].
+octave_value decode_tree(const matvar_t *root)
+{
+    phase_timer timer (io_stats::decode);
+
+    struct frame
+    {
+        const matvar_t *var;
+        octave_value *dst;
+        std::vector<octave_value> parts;
+        bool expanded = false;
+    };
+
+    octave_value retval;
+
+    // A deque, so frames don't move when children are pushed
+    std::deque<frame> stack;
+    stack.push_back({root, &retval});
+
+    while (!stack.empty()) {
+        frame& f = stack.back();
+        const matvar_t *var = f.var;
+
+        bool is_struct = (var != NULL && var->class_type == MAT_C_STRUCT);
+        bool is_cell = (var != NULL && var->class_type == MAT_C_CELL);
+
+        if (!(is_struct || is_cell)) {
+            *f.dst = (var != NULL) ? decode_leaf(var) : octave_value ();
+            if (f.dst->is_undefined()) {
+                *f.dst = Matrix ();
+            }
+            stack.pop_back();
+            continue;
+        }
+
+        dim_vector dv = mat_dims(var);
+        std::size_t nel = dv.numel();
+        std::size_t nf = is_struct ? Mat_VarGetNumberOfFields(const_cast<matvar_t *> (var)) : 1;
+        std::size_t n = (var->data != NULL) ? nel * nf : 0;
+
+        // Element i, field k is at kids[i*nf + k]
+        if (!f.expanded) {
+            f.expanded = true;
+            f.parts.resize(nel * nf);
+            matvar_t **kids = static_cast<matvar_t **> (var->data);
+            for (std::size_t i = n; i-- > 0; ) {
+                stack.push_back({kids[i], &f.parts[i]});
+            }
+            continue;
+        }
+
+        if (is_cell) {
+            Cell c (dv);
+            for (std::size_t i = 0; i < nel; ++i) {
+                c(i) = f.parts[i].is_defined() ? f.parts[i] : octave_value (Matrix ());
+            }
+            *f.dst = c;
+        } else {
+            char * const *fieldnames = Mat_VarGetStructFieldnames(var);
+            octave_map m (dv);
+            for (std::size_t k = 0; k < nf; ++k) {
+                Cell c (dv);
+                for (std::size_t i = 0; i < nel; ++i) {
+                    const octave_value& part = f.parts[i*nf + k];
+                    c(i) = part.is_defined() ? part : octave_value (Matrix ());
+                }
+                m.assign(fieldnames[k], c);
+            }
+            *f.dst = (nel == 1) ? octave_value (m.checkelem(0)) : octave_value (m);
+        }
+
+        stack.pop_back();
+    }
+
+    return retval;
+}
+
+// Decode one variable.  matvar only holds the header (Mat_VarReadNextInfo);
+// numeric classes are read straight into Octave storage, everything else
+// falls back to a full Mat_VarRead of the same variable.  Returns an
+// undefined value for types that can't be read.  Like everything it calls,
+// this must not call into the interpreter (see decode_file).
+octave_value read_var(mat_t *matfp, matvar_t *matvar)
+{
+    bool cplx = matvar->isComplex;
+
+    octave_value val = read_block(matfp, matvar, full_hyperslab(matvar));
+    if (val.is_defined()) {
+        return val;
+    }
+
+    // Octave has no complex integer types
+    if (cplx && matvar->class_type != MAT_C_SPARSE) {
+        return octave_value ();
+    }
+
+    matvar_t *full = Mat_VarRead (matfp, matvar->name);
+    if (full == NULL) {
+        throw read_error (std::string ("matiotest: could not read variable '")
+                          + matvar->name + "'");
+    }
+
+    octave_value retval;
+    switch (full->class_type) {
+        case MAT_C_CHAR:
+            retval = decode_char(full);
+            break;
+        case MAT_C_SPARSE:
+            retval = decode_sparse(full);
+            break;
+        case MAT_C_CELL:
+        case MAT_C_STRUCT:
+            retval = decode_tree(full);
+            break;
+        default:
+            // Unknown class, reported by the caller
+            break;
+    }
+
+    Mat_VarFree (full);
+
+    return retval;
+}
+
+// Bookkeeping variables that matiotest adds to a file start with this
+// prefix.  readclass keeps them out of the struct that is handed to loadobj.
+static const std::string meta_prefix = "_matiotest_";
+
+bool is_meta_name(const std::string& name)
+{
+    return name.compare(0, meta_prefix.size(), meta_prefix) == 0;
+}
+
+// Properties that shared their data with another property when they were
+// saved are stored as "alias=target" pairs in _matiotest_refs (see
+// write_mat).  Pointing them at the same octave_value restores the sharing.
+std::vector<std::pair<std::string, std::string>> read_refs(const octave_scalar_map& meta)
+{
+    std::vector<std::pair<std::string, std::string>> refs;
+    if (!meta.isfield(meta_prefix + "refs")) {
+        return refs;
+    }
+
+    std::istringstream pairs (meta.getfield(meta_prefix + "refs").string_value());
+    std::string pair;
+    while (std::getline(pairs, pair, ',')) {
+        std::size_t eq = pair.find('=');
+        if (eq != std::string::npos) {
+            refs.emplace_back(pair.substr(0, eq), pair.substr(eq + 1));
+        }
+    }
+
+    return refs;
+}
+
+void apply_refs(octave_scalar_map& st, const octave_scalar_map& meta)
+{
+    for (const auto& ref : read_refs(meta)) {
+        if (st.isfield(ref.second)) {
+            st.assign(ref.first, st.getfield(ref.second));
+        }
+    }
+}
+
+// Whether reading filename has to hold matio_mutex.  v7.3 files are HDF5,
+// which is not thread safe; v5 files are read by matio itself, so several
+// of them can be decoded at once.  The format is taken from the version
+// field of the 128 byte MAT header.  Anything that isn't recognizably v5 is
+// treated as HDF5.
+bool needs_matio_lock(const std::string& filename)
+{
+    std::ifstream is (filename, std::ios::binary);
+    unsigned char header[128];
+    if (!is.read(reinterpret_cast<char *> (header), sizeof (header))) {
+        return true;
+    }
+
+    unsigned int version;
+    if (header[126] == 'I' && header[127] == 'M') {
+        version = header[124] | (header[125] << 8);
+    } else if (header[126] == 'M' && header[127] == 'I') {
+        version = (header[124] << 8) | header[125];
+    } else {
+        return true;
+    }
+
+    return version != 0x0100;
+}
+
+// Everything read from one file, before it is checked and handed to the
+// interpreter
+struct decoded_file
+{
+    octave_scalar_map st;
+    octave_scalar_map meta;
+    std::map<std::string, uint32_t> checksums;
+
+    // Variables whose type can't be read
+    std::vector<std::string> skipped;
+
+    // Empty on success
+    std::string error;
+};
+
+// Read all variables of a file.  This doesn't call into the interpreter, so
+// it can run on worker threads (see load_files); errors are returned in
+// the result.
+decoded_file decode_file(const std::string& filename)
+{
+    decoded_file df;
+
+    std::unique_lock<std::mutex> matio_lock (matio_mutex, std::defer_lock);
+    if (needs_matio_lock(filename)) {
+        matio_lock.lock();
+    }
+
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        df.error = "matiotest: could not open file";
+        return df;
+    }
+
+    // Iterate through the variables in the MAT file
+    matvar_t *matvar; 
+    while ( (matvar = Mat_VarReadNextInfo(matfp)) != NULL) {
+
+        if (verbosity >= 3) {
+            Mat_VarPrint(matvar, 0);
+        }
+
+        // std::string does a deep copy
+        std::string name (matvar->name);
+
+        octave_value val;
+        try {
+            phase_timer timer (io_stats::read);
+            val = read_var(matfp, matvar);
+        } catch (const std::exception& e) {
+            df.error = e.what();
+            Mat_VarFree(matvar);
+            break;
+        }
+        Mat_VarFree(matvar);
+
+        if (is_meta_name(name)) {
+            df.meta.assign(name, val);
+        } else if (val.is_defined()) {
+            df.st.assign(name, val);
+            stats.add_variable(name, val.byte_size(), false);
+
+            uint32_t crc;
+            if (value_checksum(val, crc)) {
+                df.checksums[name] = crc;
+            }
+        } else {
+            df.skipped.push_back(name);
+        }
+    }
+
+    return df;
+}
+
+// Report what decode_file found wrong with a file, check the checksums, and
+// restore the properties stored as references.  If the file has checksums
+// (see writeclass), every variable is checked.
+void finish_decode(decoded_file& df)
+{
+    if (!df.error.empty()) {
+        error("%s", df.error.c_str());
+    }
+
+    for (const auto& name : df.skipped) {
+        warning("matiotest: variable '%s' has a type that can't be read", name.c_str());
+    }
+
+    if (df.meta.isfield(meta_prefix + "crc")) {
+        uint32NDArray expected = df.meta.getfield(meta_prefix + "crc").uint32_array_value();
+        std::istringstream names (df.meta.getfield(meta_prefix + "crcnames").string_value());
+
+        std::string name;
+        for (octave_idx_type i = 0; std::getline(names, name, ','); ++i) {
+            auto it = df.checksums.find(name);
+            if (it == df.checksums.end()) {
+                error("matiotest: variable '%s' is missing from the file", name.c_str());
+            }
+            if (i >= expected.numel() || it->second != expected(i).value()) {
+                error("matiotest: checksum mismatch for variable '%s'", name.c_str());
+            }
+        }
+    }
+
+    apply_refs(df.st, df.meta);
+}
+
+// The checksum that _matiotest_crc holds for variable name, if any
+bool expected_checksum(const octave_scalar_map& meta, const std::string& name,
+                       uint32_t& crc)
+{
+    if (!meta.isfield(meta_prefix + "crc") || !meta.isfield(meta_prefix + "crcnames")) {
+        return false;
+    }
+
+    uint32NDArray expected = meta.getfield(meta_prefix + "crc").uint32_array_value();
+    std::istringstream names (meta.getfield(meta_prefix + "crcnames").string_value());
+
+    std::string entry;
+    for (octave_idx_type i = 0; std::getline(names, entry, ','); ++i) {
+        if (entry == name && i < expected.numel()) {
+            crc = expected(i).value();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Bookkeeping variables go to meta, or are dropped if meta is NULL
+void readclass(const std::string& filename, octave_scalar_map& st,
+               octave_scalar_map *meta = NULL)
+{
+    decoded_file df = decode_file(filename);
+    finish_decode(df);
+
+    if (verbosity >= 2) {
+        for (auto it = df.st.begin(); it != df.st.end(); ++it) {
+            octave_stdout << "matiotest: read '" << it->first << "': ";
+            if (verbosity >= 3) {
+                df.st.contents(it).short_disp(octave_stdout);
+            } else {
+                octave_stdout << df.st.contents(it).class_name() << " "
+                              << df.st.contents(it).dims().str();
+            }
+            octave_stdout << "\n";
+        }
+    }
+
+    st = df.st;
+    if (meta != NULL) {
+        *meta = df.meta;
+    }
+}
+
+// Quote a string so it can be pasted into Octave source code
+std::string quote_string(const std::string& str)
+{
+    std::string retval = "'";
+    for (char c : str) {
+        if (c == '\'') {
+            retval += '\'';
+        }
+        retval += c;
+    }
+    retval += '\'';
+
+    return retval;
+}
+
+// A lazy property is an anonymous function that reads the variable when it
+// is called, e.g.  data = st.data ();  Only the variable directory is read up
+// front, so the cost of a load depends on which properties the caller uses.
+// All placeholders of one load share cache, a containers.Map that 'fetch'
+// stores each value in, so a property is read and decoded once however
+// often it is called; the cache lives as long as the placeholders do.  The
+// outer function only exists to capture cache.
+octave_value make_placeholder(const std::string& filename, const std::string& name,
+                              const octave_value& cache)
+{
+    std::string code = "@(cache) @() matiotest ('fetch', " + quote_string(filename)
+                       + ", " + quote_string(name) + ", cache)";
+
+    int parse_status = 0;
+    octave_value maker = interp->eval_string(code, true, parse_status);
+    if (parse_status != 0 || !maker.is_function_handle()) {
+        error("matiotest: could not create placeholder for variable '%s'", name.c_str());
+    }
+
+    return interp->feval(maker, ovl(cache), 1)(0);
+}
+
+// Bookkeeping variables are small and are read right away into meta
+void readclass_lazy(const std::string& filename, octave_scalar_map& st,
+                    octave_scalar_map& meta)
+{
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
+    }
+
+    // The placeholders may be called after the working directory changed
+    std::string path = std::filesystem::absolute(filename).string();
+
+    octave_value cache = interp->feval("containers.Map",
+                                       ovl("KeyType", "char", "ValueType", "any"), 1)(0);
+
+    matvar_t *next;
+    while ( (next = Mat_VarReadNextInfo(matfp)) != NULL) {
+        matvar_ptr matvar (next);
+        std::string name (matvar->name);
+
+        if (is_meta_name(name)) {
+            meta.assign(name, read_var(matfp, matvar.get()));
+        } else {
+            st.assign(name, make_placeholder(path, name, cache));
+        }
+    }
+
+    for (const auto& ref : read_refs(meta)) {
+        st.assign(ref.first, make_placeholder(path, ref.second, cache));
+    }
+}
+
+// Read a single variable on behalf of a lazy placeholder.  If the file has
+// checksums (see writeclass), the variable is checked like a full load
+// checks it in finish_decode.
+octave_value fetch_var(const std::string& filename, const std::string& name)
+{
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
+    }
+
+    matvar_ptr matvar (Mat_VarReadInfo(matfp, name.c_str()));
+    if (matvar == NULL) {
+        error("matiotest: variable '%s' not found in file", name.c_str());
+    }
+
+    octave_value val = read_var(matfp, matvar.get());
+
+    octave_scalar_map meta;
+    for (const std::string& meta_name : {meta_prefix + "crc", meta_prefix + "crcnames"}) {
+        matvar_ptr meta_var (Mat_VarReadInfo(matfp, meta_name.c_str()));
+        if (meta_var != NULL) {
+            meta.assign(meta_name, read_var(matfp, meta_var.get()));
+        }
+    }
+
+    uint32_t expected;
+    if (expected_checksum(meta, name, expected)) {
+        uint32_t crc;
+        if (!value_checksum(val, crc) || crc != expected) {
+            error("matiotest: checksum mismatch for variable '%s'", name.c_str());
+        }
+    }
+
+    return val;
+}
+
+// Octave class name for the header of a variable
+std::string mat_class_name(const matvar_t *matvar)
+{
+    switch (matvar->class_type) {
+        case MAT_C_DOUBLE: return "double";
+        case MAT_C_SINGLE: return "single";
+        case MAT_C_INT8: return "int8";
+        case MAT_C_UINT8: return matvar->isLogical ? "logical" : "uint8";
+        case MAT_C_INT16: return "int16";
+        case MAT_C_UINT16: return "uint16";
+        case MAT_C_INT32: return "int32";
+        case MAT_C_UINT32: return "uint32";
+        case MAT_C_INT64: return "int64";
+        case MAT_C_UINT64: return "uint64";
+        case MAT_C_CHAR: return "char";
+        case MAT_C_CELL: return "cell";
+        case MAT_C_STRUCT: return "struct";
+        case MAT_C_SPARSE: return "double";
+        default: return "unknown";
+    }
+}
+
+// The directory of a file in the layout of _matiotest_index (see
+// write_index).  v7.3 files are HDF5, where Mat_VarReadInfo opens a dataset
+// by name, so reading the index costs one lookup however many properties
+// the file has.  Files without an index are listed from the variable
+// headers, which still doesn't decode any data.
+octave_map list_vars(mat_t *matfp)
+{
+    matvar_ptr index_var (Mat_VarReadInfo(matfp, (meta_prefix + "index").c_str()));
+    if (index_var != NULL) {
+        return read_var(matfp, index_var.get()).map_value();
+    }
+
+    std::vector<octave_scalar_map> entries;
+    matvar_t *next;
+    while ( (next = Mat_VarReadNextInfo(matfp)) != NULL) {
+        matvar_ptr guard (next);
+        const matvar_t *matvar = next;
+        if (!is_meta_name(matvar->name)) {
+            dim_vector dv = mat_dims(matvar);
+            Matrix d (1, dv.ndims());
+            for (int k = 0; k < dv.ndims(); ++k) {
+                d(k) = dv(k);
+            }
+
+            double bytes = static_cast<double> (dv.numel())
+                           * Mat_SizeOfClass(matvar->class_type)
+                           * (matvar->isComplex ? 2 : 1);
+
+            octave_scalar_map e;
+            e.assign("name", std::string (matvar->name));
+            e.assign("class", mat_class_name(matvar));
+            e.assign("dims", d);
+            e.assign("bytes", bytes);
+            e.assign("ref", std::string ());
+            entries.push_back(e);
+        }
+    }
+
+    octave_map index (dim_vector (entries.size(), 1));
+    static const char *fields[] = {"name", "class", "dims", "bytes", "ref"};
+    for (const char *field : fields) {
+        Cell c (index.dims());
+        for (std::size_t j = 0; j < entries.size(); ++j) {
+            c(j) = entries[j].getfield(field);
+        }
+        index.assign(field, c);
+    }
+
+    return index;
+}
+
+octave_map list_file(const std::string& filename)
+{
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
+    }
+
+    return list_vars(matfp);
+}
+
+// Read the named properties and nothing else.  Properties stored as
+// references are looked up in the index and share the data of their
+// target, as they do after a full load.
+octave_scalar_map get_vars(const std::string& filename, const string_vector& names)
+{
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
+    }
+
+    std::map<std::string, std::string> refs;
+    matvar_ptr index_var (Mat_VarReadInfo(matfp, (meta_prefix + "index").c_str()));
+    if (index_var != NULL) {
+        octave_map index = read_var(matfp, index_var.get()).map_value();
+
+        Cell name = index.contents("name");
+        Cell ref = index.contents("ref");
+        for (octave_idx_type j = 0; j < index.numel(); ++j) {
+            std::string target = ref(j).string_value();
+            if (!target.empty()) {
+                refs[name(j).string_value()] = target;
+            }
+        }
+    }
+
+    octave_scalar_map st;
+    std::map<std::string, octave_value> read;
+    for (octave_idx_type i = 0; i < names.numel(); ++i) {
+        std::string name = names(i);
+        auto r = refs.find(name);
+        std::string target = (r != refs.end()) ? r->second : name;
+
+        auto it = read.find(target);
+        if (it == read.end()) {
+            matvar_ptr matvar (Mat_VarReadInfo(matfp, target.c_str()));
+            if (matvar == NULL) {
+                error("matiotest: variable '%s' not found in file", target.c_str());
+            }
+            it = read.emplace(target, read_var(matfp, matvar.get())).first;
+        }
+
+        st.assign(name, it->second);
+    }
+
+    return st;
+}
+
+// Convert one index argument of a 'slice' request to matio's start, stride
+// and edge for dimension dim.  The index must be ':' or an increasing
+// arithmetic sequence such as 5, 1:100 or 1:10:end_value.
+void slice_index(const octave_value& idx, int dim, std::size_t len, hyperslab& hs)
+{
+    // Everything below fits in an int once len does
+    if (len > static_cast<std::size_t> (std::numeric_limits<int>::max ())) {
+        error("matiotest: dimension %d has %zu elements, too many to slice", dim+1, len);
+    }
+
+    if (idx.is_string()) {
+        if (idx.string_value() != ":") {
+            error("matiotest: slice index %d must be ':' or numeric.", dim+1);
+        }
+        hs.start[dim] = 0;
+        hs.stride[dim] = 1;
+        hs.edge[dim] = static_cast<int> (len);
+        return;
+    }
+
+    octave::idx_vector iv = idx.index_vector();
+    octave_idx_type n = iv.length(len);
+    if (n == 0) {
+        error("matiotest: slice index %d is empty.", dim+1);
+    }
+    if (iv.extent(len) > static_cast<octave_idx_type> (len)) {
+        error("matiotest: slice index %d out of bound %zu", dim+1, len);
+    }
+
+    octave_idx_type step = (n > 1) ? iv(1) - iv(0) : 1;
+    if (step <= 0) {
+        error("matiotest: slice index %d must be increasing.", dim+1);
+    }
+    for (octave_idx_type i = 2; i < n; ++i) {
+        if (iv(i) - iv(i-1) != step) {
+            error("matiotest: slice index %d must have a constant stride.", dim+1);
+        }
+    }
+
+    hs.start[dim] = static_cast<int> (iv(0));
+    hs.stride[dim] = static_cast<int> (step);
+    hs.edge[dim] = static_cast<int> (n);
+}
+
+// Read a sub-block of a single numeric variable without touching the rest
+// of it.  idx holds one index per dimension; missing trailing indices select
+// the whole dimension.
+octave_value read_slice(const std::string& filename, const std::string& name,
+                        const octave_value_list& idx)
+{
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
+    }
+
+    matvar_ptr matvar (Mat_VarReadInfo(matfp, name.c_str()));
+    if (matvar == NULL) {
+        error("matiotest: variable '%s' not found in file", name.c_str());
+    }
+
+    int rank = matvar->rank;
+    if (idx.length() > rank) {
+        error("matiotest: too many slice indices for variable '%s' with %d dimensions",
+              name.c_str(), rank);
+    }
+
+    hyperslab hs = full_hyperslab(matvar.get());
+    for (int i = 0; i < idx.length(); ++i) {
+        slice_index(idx(i), i, matvar->dims[i], hs);
+    }
+
+    octave_value val = read_block(matfp, matvar.get(), hs);
+
+    if (val.is_undefined()) {
+        error("matiotest: variable '%s' is not numeric and can't be sliced", name.c_str());
+    }
+
+    return val;
+}
+
+octave_scalar_map saveobj(
+    octave_value obj, // this is the cdef_object 
+    octave::cdef_method& loadobj_method)
+{
+    phase_timer timer (io_stats::saveobj);
+
+    octave_value_list args;
+    args(0) = obj; 
+    octave_value_list retval = loadobj_method.execute(obj, 1);
+
+    if (!retval(0).is_defined() || !retval(0).isstruct()) {
+        error("matiotest: saveobj method did not return a scalar map.");
+    }
+
+    octave_scalar_map st = retval(0).scalar_map_value();
+    
+    return st;
+}
+
+// What is saved of an object: what saveobj returns if its class defines
+// one, otherwise its saved properties, which load_object assigns back when
+// the class has no loadobj
+octave_scalar_map object_snapshot(const octave_value& obj, const class_info& info)
+{
+    if (info.saveobj.ok()) {
+        if (info.saveobj.is_static()) {
+            error("matiotest: 'saveobj' method should not be static.");
+        }
+
+        octave::cdef_method saveobj_method = info.saveobj;
+        return saveobj(obj, saveobj_method);
+    }
+
+    octave::cdef_object cdef = octave::to_cdef(obj);
+    octave_scalar_map st;
+    for (const auto& property : info.properties) {
+        if (property.is_saved()) {
+            st.assign(property.name, cdef.get_property(0, property.name));
+        }
+    }
+
+    return st;
+}
+
+// lookup_class, counted in the lookup phase of the stats
+template <typename... Args>
+const class_info& timed_lookup_class(Args&&... args)
+{
+    phase_timer timer (io_stats::lookup);
+    return lookup_class(std::forward<Args>(args)...);
+}
+
+// Classdef objects inside properties are stored as structs.  Lowering
+// happens on the interpreter thread before the encoder threads see the
+// values, since it runs saveobj and reads properties; raising happens on the
+// interpreter thread after the file is decoded.  An object becomes a scalar
+// struct with a _matiotest_class field naming its class and one field per
+// saved property (or per field of what saveobj returns).  An object array
+// becomes a struct with _matiotest_class and a cell _matiotest_array of its
+// lowered elements.
+//
+// Handle objects keep their identity: the first occurrence gets a
+// _matiotest_id number, and every later occurrence of the same handle is
+// stored as just a _matiotest_ref to it, so cycles and handles shared
+// between properties come back as one object.
+//
+// Both directions walk the values with an explicit stack, in the same order,
+// so an id is always seen before its refs.  The properties of the top level
+// struct are visited sorted by name, since an incremental save can change
+// the order of the variables in the file.
+
+static const std::string class_marker = meta_prefix + "class";
+static const std::string array_marker = meta_prefix + "array";
+static const std::string id_marker = meta_prefix + "id";
+static const std::string ref_marker = meta_prefix + "ref";
+
+// matio's Mat_VarWrite and Mat_VarRead (and, for v7.3 files, HDF5) recurse
+// once per level of structs and cells, so lower_value refuses values nested
+// deeper than this rather than risk overflowing the C stack in there.  An
+// object counts as one level (it becomes a struct), an object array as two
+// (a struct holding a cell).
+static const int max_nesting_depth = 128;
+
+// Handle identities for one save
+struct lower_context
+{
+    std::map<const octave::cdef_object_rep *, double> ids;
+};
+
+// Objects by id for one load
+struct raise_context
+{
+    std::map<double, octave::cdef_object> objects;
+};
+
+// Whether every lowered child is still the value it was made from
+bool same_reps(const std::vector<octave_value>& a, const std::vector<octave_value>& b)
+{
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        if (&a[i].get_rep() != &b[i].get_rep()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Rebuild a struct or cell from its transformed children, in the layout
+// lower_value and raise_value use: cell elements in order, or struct
+// field k of element i at k*nel + i.  Values without any changed child are
+// returned as they are, so their data stays shared.
+octave_value rebuild_container(const octave_value& src, const string_vector& keys,
+                               const std::vector<octave_value>& kids,
+                               const std::vector<octave_value>& parts)
+{
+    if (same_reps(kids, parts)) {
+        return src;
+    }
+
+    dim_vector dv = src.dims();
+    octave_idx_type nel = dv.numel();
+
+    if (src.iscell()) {
+        Cell c (dv);
+        for (octave_idx_type i = 0; i < nel; ++i) {
+            c(i) = parts[i];
+        }
+        return c;
+    }
+
+    octave_map m (dv);
+    for (octave_idx_type k = 0; k < keys.numel(); ++k) {
+        Cell c (dv);
+        for (octave_idx_type i = 0; i < nel; ++i) {
+            c(i) = parts[k*nel + i];
+        }
+        m.assign(keys(k), c);
+    }
+
+    return (nel == 1) ? octave_value (m.checkelem(0)) : octave_value (m);
+}
+
+// Children of a struct or cell in rebuild_container's layout
+void container_children(const octave_value& val, string_vector& keys,
+                        std::vector<octave_value>& kids)
+{
+    if (val.iscell()) {
+        Cell c = val.cell_value();
+        kids.assign(c.data(), c.data() + c.numel());
+        return;
+    }
+
+    octave_map m = val.map_value();
+    keys = m.keys();
+    for (octave_idx_type k = 0; k < keys.numel(); ++k) {
+        const Cell& c = m.contents(keys(k));
+        kids.insert(kids.end(), c.data(), c.data() + c.numel());
+    }
+}
+
+octave_value lower_value(const octave_value& val, lower_context& ctx)
+{
+    struct frame
+    {
+        octave_value src;
+        octave_value *dst;
+
+        // Containers above this one in the lowered value
+        int depth = 0;
+        bool expanded = false;
+
+        string_vector keys;
+        std::vector<octave_value> kids;
+        std::vector<octave_value> parts;
+
+        // Set for objects and object arrays
+        std::string class_name;
+        double id = 0;
+        bool is_object = false;
+        bool is_array = false;
+    };
+
+    octave_value retval;
+
+    // A deque, so frames don't move when children are pushed
+    std::deque<frame> stack;
+    stack.push_back({val, &retval});
+
+    while (!stack.empty()) {
+        frame& f = stack.back();
+
+        if (!f.expanded) {
+            if (f.src.is_classdef_object()) {
+                octave::cdef_object obj = octave::to_cdef(f.src);
+                f.is_object = true;
+                f.class_name = obj.class_name();
+
+                if (obj.is_array()) {
+                    f.is_array = true;
+                    Array<octave::cdef_object> objs = obj.array_value();
+                    for (octave_idx_type i = 0; i < objs.numel(); ++i) {
+                        f.kids.push_back(octave::to_ov(objs(i)));
+                    }
+                } else {
+                    if (obj.is_handle_object()) {
+                        auto it = ctx.ids.find(obj.get_rep());
+                        if (it != ctx.ids.end()) {
+                            octave_scalar_map ref;
+                            ref.assign(ref_marker, it->second);
+                            *f.dst = ref;
+                            stack.pop_back();
+                            continue;
+                        }
+                        f.id = static_cast<double> (ctx.ids.size() + 1);
+                        ctx.ids[obj.get_rep()] = f.id;
+                    }
+
+                    const class_info& info = timed_lookup_class(obj.get_class());
+                    octave_scalar_map st = object_snapshot(f.src, info);
+
+                    f.keys = st.fieldnames();
+                    for (octave_idx_type k = 0; k < f.keys.numel(); ++k) {
+                        f.kids.push_back(st.getfield(f.keys(k)));
+                    }
+                }
+            } else if (f.src.isstruct() || f.src.iscell()) {
+                container_children(f.src, f.keys, f.kids);
+            } else {
+                *f.dst = f.src;
+                stack.pop_back();
+                continue;
+            }
+
+            if (f.depth >= max_nesting_depth) {
+                error("matiotest: properties are nested more than %d levels deep, "
+                      "which can't be written", max_nesting_depth);
+            }
+
+            f.expanded = true;
+            f.parts.resize(f.kids.size());
+            int depth = f.depth + (f.is_array ? 2 : 1);
+            for (std::size_t i = f.kids.size(); i-- > 0; ) {
+                stack.push_back({f.kids[i], &f.parts[i], depth});
+            }
+            continue;
+        }
+
+        if (!f.is_object) {
+            *f.dst = rebuild_container(f.src, f.keys, f.kids, f.parts);
+        } else {
+            octave_scalar_map st;
+            st.assign(class_marker, f.class_name);
+            if (f.is_array) {
+                Cell c (octave::to_cdef(f.src).array_value().dims());
+                for (std::size_t i = 0; i < f.parts.size(); ++i) {
+                    c(i) = f.parts[i];
+                }
+                st.assign(array_marker, c);
+            } else {
+                if (f.id > 0) {
+                    st.assign(id_marker, f.id);
+                }
+                for (octave_idx_type k = 0; k < f.keys.numel(); ++k) {
+                    st.assign(f.keys(k), f.parts[k]);
+                }
+            }
+            *f.dst = st;
+        }
+
+        stack.pop_back();
+    }
+
+    return retval;
+}
+
+// Field names of st in the order lower_struct and raise_struct visit them
+std::vector<std::string> sorted_fields(const octave_scalar_map& st)
+{
+    std::vector<std::string> names;
+    for (auto it = st.begin(); it != st.end(); ++it) {
+        names.push_back(it->first);
+    }
+    std::sort(names.begin(), names.end());
+
+    return names;
+}
+
+// Lower every property of a struct that is about to be written, with one
+// identity table for the whole object
+octave_scalar_map lower_struct(const octave_scalar_map& st)
+{
+    phase_timer timer (io_stats::lower);
+
+    lower_context ctx;
+    octave_scalar_map retval = st;
+    for (const auto& name : sorted_fields(st)) {
+        retval.assign(name, lower_value(st.getfield(name), ctx));
+    }
+
+    return retval;
+}
+
+// load_object, counted in the loadobj phase of the stats
+template <typename... Args>
+octave_value timed_load_object(Args&&... args)
+{
+    phase_timer timer (io_stats::loadobj);
+    return load_object(std::forward<Args>(args)...);
+}
+
+// Undo lower_value
+octave_value raise_value(const octave_value& val, raise_context& ctx)
+{
+    struct frame
+    {
+        octave_value src;
+        octave_value *dst;
+        bool expanded = false;
+
+        string_vector keys;
+        std::vector<octave_value> kids;
+        std::vector<octave_value> parts;
+
+        // Set for objects and object arrays
+        std::string class_name;
+        octave::cdef_object obj;
+        dim_vector dv;
+        bool is_object = false;
+        bool is_array = false;
+    };
+
+    octave_value retval;
+
+    // A deque, so frames don't move when children are pushed
+    std::deque<frame> stack;
+    stack.push_back({val, &retval});
+
+    while (!stack.empty()) {
+        frame& f = stack.back();
+
+        if (!f.expanded) {
+            if (!(f.src.isstruct() || f.src.iscell())) {
+                *f.dst = f.src;
+                stack.pop_back();
+                continue;
+            }
+
+            octave_scalar_map st;
+            if (f.src.isstruct() && f.src.numel() == 1) {
+                st = f.src.scalar_map_value();
+            }
+
+            if (st.isfield(ref_marker)) {
+                double id = st.getfield(ref_marker).double_value();
+                auto it = ctx.objects.find(id);
+                if (it == ctx.objects.end()) {
+                    error("matiotest: reference to unknown object %g", id);
+                }
+                *f.dst = octave::to_ov(it->second);
+                stack.pop_back();
+                continue;
+            }
+
+            if (st.isfield(class_marker)) {
+                f.is_object = true;
+                f.class_name = st.getfield(class_marker).string_value();
+
+                if (st.isfield(array_marker)) {
+                    f.is_array = true;
+                    Cell c = st.getfield(array_marker).cell_value();
+                    f.dv = c.dims();
+                    f.kids.assign(c.data(), c.data() + c.numel());
+                } else {
+                    // Construct handles up front, so refs inside their own
+                    // properties resolve to them
+                    if (st.isfield(id_marker)) {
+                        f.obj = new_object(timed_lookup_class(f.class_name, "matiotest"));
+                        ctx.objects[st.getfield(id_marker).double_value()] = f.obj;
+                    }
+                    for (auto it = st.begin(); it != st.end(); ++it) {
+                        if (!is_meta_name(it->first)) {
+                            f.keys.append(it->first);
+                            f.kids.push_back(st.contents(it));
+                        }
+                    }
+                }
+            } else {
+                container_children(f.src, f.keys, f.kids);
+            }
+
+            f.expanded = true;
+            f.parts.resize(f.kids.size());
+            for (std::size_t i = f.kids.size(); i-- > 0; ) {
+                stack.push_back({f.kids[i], &f.parts[i]});
+            }
+            continue;
+        }
+
+        if (!f.is_object) {
+            *f.dst = rebuild_container(f.src, f.keys, f.kids, f.parts);
+        } else if (f.is_array) {
+            const class_info& info = timed_lookup_class(f.class_name, "matiotest");
+            Array<octave::cdef_object> objs (f.dv);
+            for (std::size_t i = 0; i < f.parts.size(); ++i) {
+                objs(i) = octave::to_cdef(f.parts[i]);
+            }
+            octave::cdef_object arr (new octave::cdef_object_array (objs));
+            arr.set_class(info.cls);
+            *f.dst = octave::to_ov(arr);
+        } else {
+            octave_scalar_map st;
+            for (octave_idx_type k = 0; k < f.keys.numel(); ++k) {
+                st.assign(f.keys(k), f.parts[k]);
+            }
+            *f.dst = timed_load_object(timed_lookup_class(f.class_name, "matiotest"), st, f.obj);
+        }
+
+        stack.pop_back();
+    }
+
+    return retval;
+}
+
+// A lazy load fetches properties one at a time, so a handle that is shared
+// between properties can't be resolved there
+void raise_struct(octave_scalar_map& st)
+{
+    phase_timer timer (io_stats::raise);
+
+    raise_context ctx;
+    for (const auto& name : sorted_fields(st)) {
+        st.assign(name, raise_value(st.getfield(name), ctx));
+    }
+}
+
+// Octave dimensions in the form Mat_VarCreate wants them
+std::vector<size_t> to_mat_dims(const dim_vector& dv)
+{
+    std::vector<size_t> dims (dv.ndims());
+    for (int i = 0; i < dv.ndims(); ++i) {
+        dims[i] = static_cast<size_t> (dv(i));
+    }
+
+    return dims;
+}
+
+// Compile time mapping from Octave array types to the matio class and data
+// type they are written as.  flags is or-ed into the Mat_VarCreate options.
+template <typename ArrayT> struct matio_traits;
+
+#define MATIO_TRAITS(ArrayT, CLASS, TYPE, FLAGS)                        \
+    template <>                                                         \
+    struct matio_traits<ArrayT>                                         \
+    {                                                                   \
+        static const matio_classes class_type = CLASS;                  \
+        static const matio_types data_type = TYPE;                      \
+        static const int flags = FLAGS;                                 \
+    }
+
+MATIO_TRAITS (NDArray, MAT_C_DOUBLE, MAT_T_DOUBLE, 0);
+MATIO_TRAITS (FloatNDArray, MAT_C_SINGLE, MAT_T_SINGLE, 0);
+MATIO_TRAITS (int8NDArray, MAT_C_INT8, MAT_T_INT8, 0);
+MATIO_TRAITS (int16NDArray, MAT_C_INT16, MAT_T_INT16, 0);
+MATIO_TRAITS (int32NDArray, MAT_C_INT32, MAT_T_INT32, 0);
+MATIO_TRAITS (int64NDArray, MAT_C_INT64, MAT_T_INT64, 0);
+MATIO_TRAITS (uint8NDArray, MAT_C_UINT8, MAT_T_UINT8, 0);
+MATIO_TRAITS (uint16NDArray, MAT_C_UINT16, MAT_T_UINT16, 0);
+MATIO_TRAITS (uint32NDArray, MAT_C_UINT32, MAT_T_UINT32, 0);
+MATIO_TRAITS (uint64NDArray, MAT_C_UINT64, MAT_T_UINT64, 0);
+MATIO_TRAITS (boolNDArray, MAT_C_UINT8, MAT_T_UINT8, MAT_F_LOGICAL);
+// Only for text that can't be written as UTF-16 (see create_char)
+MATIO_TRAITS (charNDArray, MAT_C_CHAR, MAT_T_UTF8, 0);
+MATIO_TRAITS (ComplexNDArray, MAT_C_DOUBLE, MAT_T_DOUBLE, MAT_F_COMPLEX);
+MATIO_TRAITS (FloatComplexNDArray, MAT_C_SINGLE, MAT_T_SINGLE, MAT_F_COMPLEX);
+
+#undef MATIO_TRAITS
+
+// Owns the matvar_t nodes of one encoded property.  Struct and cell nodes
+// are created with MAT_F_DONT_COPY_DATA over child tables that the arena
+// owns, so no node frees its children and the whole tree is released in a
+// single sweep over a flat list, without recursing.  keep holds the Octave
+// arrays that the leaves point into.
+class matvar_arena
+{
+public:
+    matvar_arena() = default;
+
+    matvar_arena(const matvar_arena&) = delete;
+    matvar_arena& operator = (const matvar_arena&) = delete;
+
+    ~matvar_arena()
+    {
+        for (matvar_t *node : m_nodes) {
+            Mat_VarFree(node);
+        }
+    }
+
+    // Returns node, or NULL if it is NULL
+    matvar_t * add(matvar_t *node, std::shared_ptr<void> keep = nullptr)
+    {
+        if (node != NULL) {
+            m_nodes.push_back(node);
+        }
+        if (keep) {
+            m_keep.push_back(keep);
+        }
+        return node;
+    }
+
+    // Zeroed table for n children, plus the NULL terminator that
+    // Mat_VarCreate counts struct fields up to
+    matvar_t ** slots(std::size_t n)
+    {
+        m_slots.emplace_back(new matvar_t *[n + 1] ());
+        return m_slots.back().get();
+    }
+
+private:
+    std::vector<matvar_t *> m_nodes;
+    std::vector<std::unique_ptr<matvar_t *[]>> m_slots;
+    std::vector<std::shared_ptr<void>> m_keep;
+};
+
+// An encoded property.  matvar is the root of a tree owned by arena, which
+// must outlive the write.
+struct encoded_var
+{
+    matvar_t *matvar = NULL;
+    std::shared_ptr<matvar_arena> arena;
+};
+
+// Hand the Octave data pointer straight to matio.  For arrays that are
+// already stored as ArrayT, octave_value_extract shares the storage of val,
+// so nothing is copied.  The dimensions are padded with trailing ones up to
+// min_rank, which Octave's dim_vector would otherwise drop.
+template <typename ArrayT>
+matvar_t * create_var(const std::string& name, const octave_value& val, matvar_arena& arena,
+                      int min_rank = 0)
+{
+    typedef matio_traits<ArrayT> traits;
+    typedef typename ArrayT::element_type T;
+
+    std::shared_ptr<ArrayT> a = std::make_shared<ArrayT> (octave_value_extract<ArrayT> (val));
+    std::vector<size_t> dims = to_mat_dims(a->dims());
+    if (static_cast<int> (dims.size()) < min_rank) {
+        dims.resize(min_rank, 1);
+    }
+
+    matvar_t *matvar = Mat_VarCreate (name.c_str(), traits::class_type, traits::data_type,
+                                      static_cast<int> (dims.size()), dims.data(),
+                                      const_cast<T *> (a->data()),
+                                      traits::flags | MAT_F_DONT_COPY_DATA);
+
+    return arena.add(matvar, a);
+}
+
+// matio wants complex data split into separate real and imaginary arrays,
+// while Octave interleaves them, so complex values are the one case that is
+// copied: a single pass deinterleaves into two buffers that the arena keeps.
+template <typename T>
+struct split_data
+{
+    std::unique_ptr<T[]> re;
+    std::unique_ptr<T[]> im;
+    mat_complex_split_t split;
+
+    split_data(const std::complex<T> *src, octave_idx_type n)
+        : re (new T[n]), im (new T[n])
+    {
+        for (octave_idx_type i = 0; i < n; ++i) {
+            re[i] = src[i].real();
+            im[i] = src[i].imag();
+        }
+        split.Re = re.get();
+        split.Im = im.get();
+    }
+};
+
+template <typename ArrayT>
+matvar_t * create_complex_var(const std::string& name, const octave_value& val,
+                              matvar_arena& arena, int min_rank = 0)
+{
+    typedef matio_traits<ArrayT> traits;
+    typedef typename ArrayT::element_type::value_type T;
+
+    ArrayT a = octave_value_extract<ArrayT> (val);
+    std::shared_ptr<split_data<T>> sd = std::make_shared<split_data<T>> (a.data(), a.numel());
+
+    std::vector<size_t> dims = to_mat_dims(a.dims());
+    if (static_cast<int> (dims.size()) < min_rank) {
+        dims.resize(min_rank, 1);
+    }
+
+    matvar_t *matvar = Mat_VarCreate (name.c_str(), traits::class_type, traits::data_type,
+                                      static_cast<int> (dims.size()), dims.data(),
+                                      &sd->split, traits::flags | MAT_F_DONT_COPY_DATA);
+
+    return arena.add(matvar, sd);
+}
+
+// A sparse matrix in matio's compressed column form.  Real and logical
+// values are handed over in place; matio's row and column indices are 32
+// bit, so those are the only arrays that are converted.
+struct sparse_data
+{
+    std::vector<mat_uint32_t> ir;
+    std::vector<mat_uint32_t> jc;
+    mat_sparse_t sparse;
+
+    // The Octave matrix the values point into, or the split copy of its
+    // complex values
+    std::shared_ptr<void> values;
+};
+
+// Returns false if the matrix is too large for 32 bit indices
+template <typename SparseT>
+bool sparse_indices(const SparseT& s, sparse_data& sd)
+{
+    octave_idx_type nnz = s.nnz();
+    octave_idx_type nc = s.cols();
+    if (nnz > std::numeric_limits<mat_uint32_t>::max ()
+        || s.rows() > std::numeric_limits<mat_uint32_t>::max ()
+        || nc >= std::numeric_limits<mat_uint32_t>::max ()) {
+        return false;
+    }
+
+    const octave_idx_type *ridx = s.ridx();
+    const octave_idx_type *cidx = s.cidx();
+    sd.ir.assign(ridx, ridx + nnz);
+    sd.jc.assign(cidx, cidx + nc + 1);
+
+    std::memset(&sd.sparse, 0, sizeof (sd.sparse));
+    sd.sparse.nzmax = nnz;
+    sd.sparse.ir = sd.ir.data();
+    sd.sparse.nir = nnz;
+    sd.sparse.jc = sd.jc.data();
+    sd.sparse.njc = nc + 1;
+    sd.sparse.ndata = nnz;
+
+    return true;
+}
+
+matvar_t * create_sparse(const std::string& name, const octave_value& val, matvar_arena& arena)
+{
+    std::shared_ptr<sparse_data> sd = std::make_shared<sparse_data> ();
+    matio_types data_type = MAT_T_DOUBLE;
+    int flags = MAT_F_DONT_COPY_DATA;
+
+    if (val.islogical()) {
+        std::shared_ptr<SparseBoolMatrix> s = std::make_shared<SparseBoolMatrix> (val.sparse_bool_matrix_value());
+        if (!sparse_indices(*s, *sd)) {
+            return NULL;
+        }
+        sd->sparse.data = const_cast<bool *> (s->data());
+        sd->values = s;
+        data_type = MAT_T_UINT8;
+        flags |= MAT_F_LOGICAL;
+    } else if (val.iscomplex()) {
+        SparseComplexMatrix s = val.sparse_complex_matrix_value();
+        if (!sparse_indices(s, *sd)) {
+            return NULL;
+        }
+        std::shared_ptr<split_data<double>> split = std::make_shared<split_data<double>> (s.data(), s.nnz());
+        sd->sparse.data = &split->split;
+        sd->values = split;
+        flags |= MAT_F_COMPLEX;
+    } else {
+        std::shared_ptr<SparseMatrix> s = std::make_shared<SparseMatrix> (val.sparse_matrix_value());
+        if (!sparse_indices(*s, *sd)) {
+            return NULL;
+        }
+        sd->sparse.data = const_cast<double *> (s->data());
+        sd->values = s;
+    }
+
+    dim_vector dv = val.dims();
+    size_t dims[2] = {static_cast<size_t> (dv(0)), static_cast<size_t> (dv(1))};
+
+    matvar_t *matvar = Mat_VarCreate (name.c_str(), MAT_C_SPARSE, data_type, 2, dims,
+                                      &sd->sparse, flags);
+
+    return arena.add(matvar, sd);
+}
+
+// A char array as UTF-16, the way MATLAB stores text (see to_utf16).  Text
+// that can't be transcoded keeps its UTF-8 bytes, which decode_char reads
+// back as they are.
+matvar_t * create_char(const std::string& name, const octave_value& val, matvar_arena& arena,
+                       int min_rank = 0)
+{
+    charNDArray a = val.char_array_value();
+    dim_vector dv = a.dims();
+
+    std::shared_ptr<std::vector<uint16_t>> units = std::make_shared<std::vector<uint16_t>> ();
+    if (!to_utf16(a.data(), a.numel(), is_text_row(dv), *units)) {
+        return create_var<charNDArray> (name, val, arena, min_rank);
+    }
+    if (static_cast<octave_idx_type> (units->size()) != dv.numel()) {
+        dv = dim_vector (1, units->size());
+    }
+
+    std::vector<size_t> dims = to_mat_dims(dv);
+    if (static_cast<int> (dims.size()) < min_rank) {
+        dims.resize(min_rank, 1);
+    }
+
+    matvar_t *matvar = Mat_VarCreate (name.c_str(), MAT_C_CHAR, MAT_T_UINT16,
+                                      static_cast<int> (dims.size()), dims.data(),
+                                      units->data(), MAT_F_DONT_COPY_DATA);
+
+    return arena.add(matvar, units);
+}
+
+// The elements of a cellstr, transcoded in bulk: the ASCII strings share
+// one UTF-16 buffer instead of each allocating its own, and only the others
+// go through create_char.  slots receives one node per element.
+bool create_cellstr(const Cell& c, matvar_t **slots, matvar_arena& arena)
+{
+    octave_idx_type nel = c.numel();
+
+    std::size_t total = 0;
+    for (octave_idx_type i = 0; i < nel; ++i) {
+        total += c(i).numel();
+    }
+    std::shared_ptr<std::vector<uint16_t>> units = std::make_shared<std::vector<uint16_t>> (total);
+
+    std::size_t offset = 0;
+    for (octave_idx_type i = 0; i < nel; ++i) {
+        charNDArray a = c(i).char_array_value();
+        std::size_t n = a.numel();
+        uint16_t *dst = units->data() + offset;
+
+        if (widen_ascii(a.data(), n, dst) == n) {
+            std::vector<size_t> dims = to_mat_dims(a.dims());
+            slots[i] = arena.add(Mat_VarCreate ("", MAT_C_CHAR, MAT_T_UINT16,
+                                                static_cast<int> (dims.size()), dims.data(),
+                                                dst, MAT_F_DONT_COPY_DATA));
+            offset += n;
+        } else {
+            slots[i] = create_char("", c(i), arena);
+        }
+        if (slots[i] == NULL) {
+            return false;
+        }
+    }
+
+    arena.add(NULL, units);
+    return true;
+}
+
+// Build the matvar_t for an array value.  Returns NULL for types that can't
+// be written.
+matvar_t * create_leaf(const std::string& name, const octave_value& val, matvar_arena& arena,
+                       int min_rank = 0)
+{
+    if (val.issparse()) {
+        return create_sparse (name, val, arena);
+    }
+
+    switch (val.builtin_type()) {
+        case btyp_double:
+            return create_var<NDArray> (name, val, arena, min_rank);
+        case btyp_complex:
+            return create_complex_var<ComplexNDArray> (name, val, arena, min_rank);
+        case btyp_float_complex:
+            return create_complex_var<FloatComplexNDArray> (name, val, arena, min_rank);
+        case btyp_float:
+            return create_var<FloatNDArray> (name, val, arena, min_rank);
+        case btyp_int8:
+            return create_var<int8NDArray> (name, val, arena, min_rank);
+        case btyp_int16:
+            return create_var<int16NDArray> (name, val, arena, min_rank);
+        case btyp_int32:
+            return create_var<int32NDArray> (name, val, arena, min_rank);
+        case btyp_int64:
+            return create_var<int64NDArray> (name, val, arena, min_rank);
+        case btyp_uint8:
+            return create_var<uint8NDArray> (name, val, arena, min_rank);
+        case btyp_uint16:
+            return create_var<uint16NDArray> (name, val, arena, min_rank);
+        case btyp_uint32:
+            return create_var<uint32NDArray> (name, val, arena, min_rank);
+        case btyp_uint64:
+            return create_var<uint64NDArray> (name, val, arena, min_rank);
+        case btyp_bool:
+            return create_var<boolNDArray> (name, val, arena, min_rank);
+        case btyp_char:
+            return create_char (name, val, arena, min_rank);
+        default:
+            return NULL;
+    }
+}
+
+// Build the matvar_t tree for one property.  Structs and cells are walked
+// with an explicit stack, but Mat_VarWrite then recurses through the tree,
+// which is why lower_value limits the depth (see max_nesting_depth).  A container is created after its children, because Mat_VarCreate
+// takes the struct field names from the child nodes.  Classdef objects must
+// have been lowered to structs first (see lower_value).
+//
+// This runs on the encoder threads (see writeclass), so it must not call
+// into the interpreter or print; a NULL matvar is reported by the caller.
+encoded_var
+write_var(const std::string& name, const octave_value& val)
+{
+    struct frame
+    {
+        octave_value val;
+        std::string name;
+        matvar_t **slot;
+        matvar_t **kids = NULL;
+        bool expanded = false;
+    };
+
+    encoded_var ev;
+    ev.arena = std::make_shared<matvar_arena> ();
+    matvar_arena& arena = *ev.arena;
+
+    // A deque, so frames don't move when children are pushed
+    std::deque<frame> stack;
+    stack.push_back({val, name, &ev.matvar});
+
+    while (!stack.empty()) {
+        frame& f = stack.back();
+
+        if (!(f.val.isstruct() || f.val.iscell())) {
+            *f.slot = create_leaf(f.name, f.val, arena);
+            if (*f.slot == NULL) {
+                return encoded_var ();
+            }
+            stack.pop_back();
+            continue;
+        }
+
+        dim_vector dv = f.val.dims();
+        std::vector<size_t> dims = to_mat_dims(dv);
+        int rank = static_cast<int> (dims.size());
+        octave_idx_type nel = dv.numel();
+
+        if (f.val.iscell()) {
+            // Cell::iscellstr only reads the elements; octave_value::iscellstr
+            // may fill octave_cell's cellstr cache, which the interpreter
+            // thread shares with us
+            Cell c = f.val.cell_value();
+            if (nel > 0 && c.iscellstr()) {
+                f.kids = arena.slots(nel);
+                if (!create_cellstr(c, f.kids, arena)) {
+                    return encoded_var ();
+                }
+                *f.slot = arena.add(Mat_VarCreate (f.name.c_str(), MAT_C_CELL, MAT_T_CELL,
+                                                   rank, dims.data(), f.kids,
+                                                   MAT_F_DONT_COPY_DATA));
+            } else if (nel == 0) {
+                *f.slot = arena.add(Mat_VarCreate (f.name.c_str(), MAT_C_CELL, MAT_T_CELL,
+                                                   rank, dims.data(), NULL, 0));
+            } else if (!f.expanded) {
+                f.expanded = true;
+                f.kids = arena.slots(nel);
+                for (octave_idx_type i = nel; i-- > 0; ) {
+                    stack.push_back({c(i), "", &f.kids[i]});
+                }
+                continue;
+            } else {
+                *f.slot = arena.add(Mat_VarCreate (f.name.c_str(), MAT_C_CELL, MAT_T_CELL,
+                                                   rank, dims.data(), f.kids,
+                                                   MAT_F_DONT_COPY_DATA));
+            }
+        } else {
+            octave_map m = f.val.map_value();
+            string_vector keys = m.keys();
+            octave_idx_type nf = keys.numel();
+
+            if (nel == 0 || nf == 0) {
+                // No children, so matio can own the (empty) field table
+                std::vector<const char *> fields (nf);
+                for (octave_idx_type k = 0; k < nf; ++k) {
+                    fields[k] = keys(k).c_str();
+                }
+                *f.slot = arena.add(Mat_VarCreateStruct (f.name.c_str(), rank, dims.data(),
+                                                         fields.data(), nf));
+            } else if (!f.expanded) {
+                // Element i, field k goes to kids[i*nf + k]
+                f.expanded = true;
+                f.kids = arena.slots(nel * nf);
+                for (octave_idx_type k = nf; k-- > 0; ) {
+                    const Cell& c = m.contents(keys(k));
+                    for (octave_idx_type i = nel; i-- > 0; ) {
+                        stack.push_back({c(i), keys(k), &f.kids[i*nf + k]});
+                    }
+                }
+                continue;
+            } else {
+                *f.slot = arena.add(Mat_VarCreate (f.name.c_str(), MAT_C_STRUCT, MAT_T_STRUCT,
+                                                   rank, dims.data(), f.kids,
+                                                   MAT_F_DONT_COPY_DATA));
+            }
+        }
+
+        if (*f.slot == NULL) {
+            return encoded_var ();
+        }
+        stack.pop_back();
+    }
+
+    return ev;
+}
+
+// Worker threads kept for the life of the module, so a save or a batch load
+// doesn't start and join threads every time.  Threads are added on first use,
+// up to the most helpers any job has asked for.  A job hands out the indices
+// [0, n) one at a time to its helpers and to the thread that started it, which
+// runs items itself while it waits (see job::run_one).  So a job always
+// finishes, even when every worker is busy elsewhere, e.g. decoding a file
+// that waits for matio_mutex while an async save holds it.
+class worker_pool
+{
+public:
+    class job
+    {
+    public:
+        job(std::size_t n, unsigned int helpers, std::function<void (std::size_t)> fn)
+            : m_n (n), m_helpers (helpers), m_fn (std::move (fn))
+        { }
+
+        // Claim the next item and run it on this thread.  Returns false if
+        // there is none left.
+        bool run_one()
+        {
+            std::size_t i;
+            {
+                std::lock_guard<std::mutex> lock (m_mutex);
+                if (m_next >= m_n) {
+                    return false;
+                }
+                i = m_next++;
+                ++m_running;
+            }
+
+            m_fn(i);
+
+            {
+                std::lock_guard<std::mutex> lock (m_mutex);
+                --m_running;
+            }
+            m_cv.notify_all();
+            return true;
+        }
+
+        // Leave the items that haven't been claimed yet
+        void cancel()
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_n = m_next;
+        }
+
+        // Help with the remaining items, then wait for the claimed ones
+        void wait()
+        {
+            while (run_one()) { }
+
+            std::unique_lock<std::mutex> lock (m_mutex);
+            m_cv.wait(lock, [this] () { return m_running == 0; });
+        }
+
+    private:
+        friend class worker_pool;
+
+        // Called by a worker that wants to help; false once the job has all
+        // the helpers it asked for or no items left
+        bool join()
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            if (m_next >= m_n || m_helpers == 0) {
+                return false;
+            }
+            --m_helpers;
+            return true;
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::size_t m_n;
+        std::size_t m_next = 0;
+        std::size_t m_running = 0;
+        unsigned int m_helpers;
+        std::function<void (std::size_t)> m_fn;
+    };
+
+    worker_pool() = default;
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator = (const worker_pool&) = delete;
+
+    // Jobs are always waited for by their callers, so the workers are idle
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto& t : m_threads) {
+            t.join();
+        }
+    }
+
+    // Start fn (i) for every i in [0, n) on up to helpers workers.  The
+    // caller must run_one () or wait () on the job.
+    std::shared_ptr<job> start(std::size_t n, unsigned int helpers,
+                               std::function<void (std::size_t)> fn)
+    {
+        auto j = std::make_shared<job> (n, helpers, std::move (fn));
+        if (helpers == 0) {
+            return j;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            while (m_threads.size() < helpers) {
+                m_threads.emplace_back([this] () { run(); });
+            }
+            m_jobs.push_back(j);
+        }
+        m_cv.notify_all();
+
+        return j;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock (m_mutex);
+        while (true) {
+            m_cv.wait(lock, [this] () { return m_stop || !m_jobs.empty(); });
+            if (m_stop) {
+                return;
+            }
+
+            std::shared_ptr<job> j = m_jobs.front();
+            if (!j->join()) {
+                m_jobs.pop_front();
+                continue;
+            }
+
+            lock.unlock();
+            while (j->run_one()) { }
+            lock.lock();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<job>> m_jobs;
+    std::vector<std::thread> m_threads;
+    bool m_stop = false;
+};
+
+// Defined before the async writer, whose saves use it, so it is destroyed
+// after it
+worker_pool workers;
+
+// Run fn (i) for every i in [0, n) on up to nthreads threads, counting the
+// calling thread.  fn must not call into the interpreter (no error (), no
+// octave_stdout) and must not throw.
+template <typename F>
+void parallel_for(std::size_t n, unsigned int nthreads, F fn)
+{
+    if (nthreads > n) {
+        nthreads = static_cast<unsigned int> (n);
+    }
+
+    if (nthreads <= 1) {
+        for (std::size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    workers.start(n, nthreads - 1, fn)->wait();
+}
+
+// Store the checksums computed while encoding, see writeclass.  Returns
+// false if matio could not write them.
+bool write_checksums(mat_t *matfp, const std::vector<std::string>& names,
+                     const std::vector<uint32_t>& crcs, const std::vector<char>& has_crc)
+{
+    std::vector<uint32_t> values;
+    std::string crcnames;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        if (has_crc[i]) {
+            values.push_back(crcs[i]);
+            crcnames += (crcnames.empty() ? "" : ",") + names[i];
+        }
+    }
+
+    if (values.empty()) {
+        return true;
+    }
+
+    size_t crc_dims[2] = {1, values.size()};
+    matvar_t *matvar = Mat_VarCreate ((meta_prefix + "crc").c_str(), MAT_C_UINT32, MAT_T_UINT32,
+                                      2, crc_dims, values.data(), 0);
+    bool ok = (matvar != NULL && Mat_VarWrite (matfp, matvar, MAT_COMPRESSION_NONE) == 0);
+    Mat_VarFree(matvar);
+    if (!ok) {
+        return false;
+    }
+
+    size_t name_dims[2] = {1, crcnames.size()};
+    matvar = Mat_VarCreate ((meta_prefix + "crcnames").c_str(), MAT_C_CHAR, MAT_T_UTF8,
+                            2, name_dims, const_cast<char *> (crcnames.data()), 0);
+    ok = (matvar != NULL && Mat_VarWrite (matfp, matvar, MAT_COMPRESSION_NONE) == 0);
+    Mat_VarFree(matvar);
+
+    return ok;
+}
+
+// Store the directory of the file in _matiotest_index: a struct array with
+// one element per property giving its name, Octave class, dims and size in
+// memory, and for properties stored as references (see write_mat) the
+// property whose data they share in ref.  'ls' and 'get' read it instead of
+// scanning the variables.  Returns false if matio could not write it.
+bool write_index(mat_t *matfp, const std::vector<std::string>& names,
+                 const std::vector<octave_value>& vals,
+                 const std::vector<std::ptrdiff_t>& alias_of)
+{
+    std::vector<std::size_t> props;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        if (!is_meta_name(names[i])) {
+            props.push_back(i);
+        }
+    }
+
+    dim_vector dv (props.size(), 1);
+    Cell name (dv), cls (dv), dims (dv), bytes (dv), ref (dv);
+    for (std::size_t j = 0; j < props.size(); ++j) {
+        std::size_t i = props[j];
+        const octave_value& val = vals[i];
+
+        name(j) = names[i];
+
+        // Lowered objects are listed with their own class
+        cls(j) = val.class_name();
+        if (val.isstruct() && val.numel() == 1) {
+            octave_scalar_map st = val.scalar_map_value();
+            if (st.isfield(class_marker)) {
+                cls(j) = st.getfield(class_marker);
+            }
+        }
+
+        dim_vector vdv = val.dims();
+        Matrix d (1, vdv.ndims());
+        for (int k = 0; k < vdv.ndims(); ++k) {
+            d(k) = vdv(k);
+        }
+        dims(j) = d;
+        bytes(j) = static_cast<double> (val.byte_size());
+        ref(j) = (alias_of[i] >= 0) ? names[alias_of[i]] : std::string ();
+    }
+
+    octave_map index (dv);
+    index.assign("name", name);
+    index.assign("class", cls);
+    index.assign("dims", dims);
+    index.assign("bytes", bytes);
+    index.assign("ref", ref);
+
+    encoded_var ev = write_var(meta_prefix + "index", index);
+    return (ev.matvar != NULL && Mat_VarWrite (matfp, ev.matvar, MAT_COMPRESSION_NONE) == 0);
+}
+
+// Properties smaller than this in total are encoded on the calling thread;
+// starting threads costs more than it saves for small objects.
+static const std::size_t parallel_encode_threshold = 1 << 20;
+
+// What the last incremental save wrote to a file.  Each value is held by
+// reference, so if a property still has the same octave_value rep it can't
+// have changed (Octave copies on write while we hold a reference).  Values
+// that are new reps are compared by checksum, which catches properties that
+// were reassigned to equal data.  The file's modification time guards
+// against the file having been rewritten by something else.
+struct written_file
+{
+    struct entry
+    {
+        octave_value value;
+        uint32_t crc = 0;
+        bool has_crc = false;
+
+        // False if the value was stored as a reference to another variable
+        bool written = true;
+    };
+
+    std::map<std::string, entry> vars;
+    std::filesystem::file_time_type mtime;
+
+    // The file's _matiotest_refs, the names in _matiotest_crcnames and the
+    // compression its variables were written with
+    std::string refs;
+    std::vector<std::string> crc_names;
+    matio_compression compression = MAT_COMPRESSION_NONE;
+};
+
+// Guarded by matio_mutex
+std::map<std::string, written_file> written_files;
+
+// Values at least this large are checked for sharing between properties
+static const std::size_t shared_threshold = 4096;
+
+bool unchanged(const written_file::entry& prev, const octave_value& val)
+{
+    if (&prev.value.get_rep() == &val.get_rep()) {
+        return true;
+    }
+
+    if (!prev.has_crc || prev.value.builtin_type() != val.builtin_type()
+        || prev.value.dims() != val.dims()) {
+        return false;
+    }
+
+    uint32_t crc;
+    return value_checksum(val, crc) && crc == prev.crc;
+}
+
+#if defined (MAT73) && MAT73
+// HDF5 memory type of the elements of a dense numeric or logical array as
+// Octave holds them, or -1.  Complex values match the {real, imag} compound
+// matio writes.  The caller closes the type.
+hid_t hdf5_memtype(const octave_value& val)
+{
+    hid_t base;
+    switch (val.builtin_type()) {
+        case btyp_double:
+        case btyp_complex:
+            base = H5T_NATIVE_DOUBLE;
+            break;
+        case btyp_float:
+        case btyp_float_complex:
+            base = H5T_NATIVE_FLOAT;
+            break;
+        case btyp_int8: base = H5T_NATIVE_INT8; break;
+        case btyp_int16: base = H5T_NATIVE_INT16; break;
+        case btyp_int32: base = H5T_NATIVE_INT32; break;
+        case btyp_int64: base = H5T_NATIVE_INT64; break;
+        case btyp_uint8: base = H5T_NATIVE_UINT8; break;
+        case btyp_uint16: base = H5T_NATIVE_UINT16; break;
+        case btyp_uint32: base = H5T_NATIVE_UINT32; break;
+        case btyp_uint64: base = H5T_NATIVE_UINT64; break;
+        case btyp_bool: base = H5T_NATIVE_UINT8; break;
+        default:
+            return -1;
+    }
+
+    if (!val.iscomplex()) {
+        return H5Tcopy(base);
+    }
+
+    size_t size = H5Tget_size(base);
+    hid_t type = H5Tcreate(H5T_COMPOUND, 2 * size);
+    H5Tinsert(type, "real", 0, base);
+    H5Tinsert(type, "imag", size, base);
+    return type;
+}
+
+// Overwrite the numel elements of dataset name with data.  The dataset
+// must hold exactly that many, so nothing is resized or moved.
+bool hdf5_overwrite(hid_t fid, const std::string& name, hid_t memtype,
+                    const void *data, octave_idx_type numel)
+{
+    hid_t dset = H5Dopen2(fid, name.c_str(), H5P_DEFAULT);
+    if (dset < 0) {
+        return false;
+    }
+
+    herr_t status = -1;
+    hid_t space = H5Dget_space(dset);
+    if (space >= 0 && H5Sget_simple_extent_npoints(space) == numel) {
+        status = H5Dwrite(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+    }
+    if (space >= 0) {
+        H5Sclose(space);
+    }
+    H5Dclose(dset);
+
+    return status >= 0;
+}
+#endif
+
+// Whether a changed property can be written over its old dataset: a
+// non-empty dense numeric or logical array with the class and dims of the
+// value that was written last time
+bool rewritable(const written_file::entry& prev, const octave_value& val)
+{
+    return (prev.written && !val.issparse() && (val.isnumeric() || val.islogical())
+            && !val.isempty() && val.builtin_type() == prev.value.builtin_type()
+            && val.dims() == prev.value.dims());
+}
+
+// Update a file written by the last incremental save without rewriting it.
+// matio can't replace a variable in place (Mat_VarDelete copies the whole
+// file to drop one), so this goes to HDF5 directly: the uncompressed
+// datasets matio writes are contiguous and have a fixed size, and a changed
+// property of the same class and dims is written over its old data.  The
+// checksums are rewritten the same way; the index and refs don't change.
+// Returns false, without touching the file, if the update can't be done
+// like that: properties were added, removed or shared differently, a changed
+// property isn't rewritable, or the file is compressed.  msg is set if
+// writing failed part way.
+bool
+rewrite_in_place(const std::string& path, written_file& wf,
+                 const std::vector<std::string>& names,
+                 const std::vector<octave_value>& vals,
+                 const std::vector<std::ptrdiff_t>& alias_of,
+                 const std::string& refs, const io_options& opts,
+                 std::string& msg)
+{
+#if defined (MAT73) && MAT73
+    if (wf.compression != MAT_COMPRESSION_NONE || opts.compression != MAT_COMPRESSION_NONE
+        || refs != wf.refs || names.size() != wf.vars.size()) {
+        return false;
+    }
+
+    std::size_t n = names.size();
+    std::vector<std::size_t> changed;
+    std::map<std::string, uint32_t> crcs;
+    for (std::size_t i = 0; i < n; ++i) {
+        auto it = wf.vars.find(names[i]);
+        if (it == wf.vars.end() || it->second.written != (alias_of[i] < 0)) {
+            return false;
+        }
+        const written_file::entry& prev = it->second;
+        if (alias_of[i] >= 0) {
+            continue;
+        }
+
+        if (unchanged(prev, vals[i])) {
+            if (prev.has_crc) {
+                crcs[names[i]] = prev.crc;
+            }
+        } else if (rewritable(prev, vals[i])) {
+            uint32_t crc;
+            if (value_checksum(vals[i], crc)) {
+                crcs[names[i]] = crc;
+            }
+            changed.push_back(i);
+        } else {
+            return false;
+        }
+    }
+
+    std::vector<uint32_t> crc_values;
+    for (const auto& name : wf.crc_names) {
+        auto it = crcs.find(name);
+        if (it == crcs.end()) {
+            return false;
+        }
+        crc_values.push_back(it->second);
+    }
+
+    if (!changed.empty()) {
+        hid_t fid = H5Fopen(path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+        if (fid < 0) {
+            return false;
+        }
+
+        for (std::size_t i : changed) {
+            // Ranges have no data buffer
+            octave_value full = vals[i].is_range() ? octave_value (vals[i].array_value()) : vals[i];
+
+            bool ok;
+            {
+                phase_timer timer (io_stats::write);
+                hid_t memtype = hdf5_memtype(full);
+                ok = (memtype >= 0 && hdf5_overwrite(fid, names[i], memtype,
+                                                     full.mex_get_data(), full.numel()));
+                if (memtype >= 0) {
+                    H5Tclose(memtype);
+                }
+            }
+            if (!ok) {
+                msg = "matiotest: could not update variable '" + names[i] + "' in place";
+                break;
+            }
+            if (!is_meta_name(names[i])) {
+                stats.add_variable(names[i], full.byte_size(), true);
+            }
+        }
+
+        if (msg.empty() && !crc_values.empty()
+            && !hdf5_overwrite(fid, meta_prefix + "crc", H5T_NATIVE_UINT32,
+                               crc_values.data(), crc_values.size())) {
+            msg = "matiotest: could not update the checksums in place";
+        }
+
+        if (H5Fclose(fid) < 0 && msg.empty()) {
+            msg = "matiotest: could not close file";
+        }
+    }
+
+    if (msg.empty()) {
+        for (std::size_t i = 0; i < n; ++i) {
+            written_file::entry& e = wf.vars[names[i]];
+            e.value = vals[i];
+            auto it = crcs.find(names[i]);
+            e.has_crc = (it != crcs.end());
+            e.crc = e.has_crc ? it->second : 0;
+        }
+        std::error_code ec;
+        wf.mtime = std::filesystem::last_write_time(path, ec);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Estimate of the bytes val takes up in a MAT file before compression: the
+// element data of every array plus a header per matvar_t.  It only has to be
+// good enough to pick the format, and it never touches the element data.
+double encoded_size(const octave_value& val)
+{
+    static const double header = 64;
+
+    double bytes = 0;
+    std::vector<octave_value> stack (1, val);
+    while (!stack.empty()) {
+        octave_value v = stack.back();
+        stack.pop_back();
+        bytes += header;
+
+        if (v.iscell()) {
+            Cell c = v.cell_value();
+            for (octave_idx_type i = 0; i < c.numel(); ++i) {
+                stack.push_back(c(i));
+            }
+        } else if (v.isstruct()) {
+            octave_map m = v.map_value();
+            for (auto it = m.begin(); it != m.end(); ++it) {
+                const Cell& c = m.contents(it);
+                for (octave_idx_type i = 0; i < c.numel(); ++i) {
+                    stack.push_back(c(i));
+                }
+            }
+        } else if (v.issparse()) {
+            double elem = v.islogical() ? 1 : v.iscomplex() ? 16 : 8;
+            double nnz = v.nnz();
+            bytes += nnz * (elem + 4) + (v.columns() + 1) * 4.0;
+        } else if (v.is_string()) {
+            // UTF-16, see create_char
+            bytes += 2.0 * v.numel();
+        } else {
+            bytes += v.byte_size();
+        }
+    }
+
+    return bytes;
+}
+
+// The v5 format stores the size of a variable in 32 bits, and MATLAB refuses
+// variables over 2 GiB
+static const double v5_variable_limit = 2147483648.0;
+
+// The format for the 'auto' policy.  v5 (v7 when compressed) has far less
+// overhead per file and per variable than HDF5, which matters most for the
+// many small files of frequent checkpoints, so it is used unless a variable
+// might not fit.
+mat_ft choose_format(const std::vector<octave_value>& vals)
+{
+    for (const auto& val : vals) {
+        if (encoded_size(val) >= v5_variable_limit) {
+            return MAT_FT_MAT73;
+        }
+    }
+
+    return MAT_FT_MAT5;
+}
+
+// Write st to a MAT file.  This does not call into the interpreter, so it can
+// run on the async writer thread; errors are returned as a message, which is
+// empty on success.
+std::string
+write_mat(const std::string& filename,
+          const octave_scalar_map& st,
+          const io_options& opts)
+{
+    std::vector<std::string> names;
+    std::vector<octave_value> vals;
+    std::size_t total_bytes = 0;
+    for (auto it = st.begin(); it != st.end(); ++it) {
+        names.push_back(it->first);
+        vals.push_back(st.contents(it));
+        total_bytes += vals.back().byte_size();
+    }
+
+    std::size_t n = names.size();
+
+    unsigned int nthreads = opts.threads;
+    if (nthreads == 0) {
+        nthreads = std::max (1u, std::thread::hardware_concurrency ());
+    }
+    if (total_bytes < parallel_encode_threshold) {
+        nthreads = 1;
+    }
+
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+    // Large values that share their rep with an earlier property are only
+    // written once; the others are recorded in _matiotest_refs as
+    // "alias=target" pairs and readclass points them back at the same data
+    std::vector<std::ptrdiff_t> alias_of (n, -1);
+    std::map<const octave_base_value *, std::size_t> identity;
+    std::string refs;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (is_meta_name(names[i]) || vals[i].byte_size() < shared_threshold) {
+            continue;
+        }
+        auto r = identity.emplace(&vals[i].get_rep(), i);
+        if (!r.second) {
+            alias_of[i] = r.first->second;
+            refs += (refs.empty() ? "" : ",") + names[i] + "=" + names[r.first->second];
+        }
+    }
+
+    // An incremental save updates the existing file in place if it is the
+    // one we wrote last time and only the data of properties changed;
+    // otherwise the whole file is written
+    std::error_code ec;
+    std::string path = std::filesystem::absolute(filename, ec).string();
+    if (opts.incremental) {
+        auto it = written_files.find(path);
+        if (it != written_files.end()
+            && std::filesystem::last_write_time(path, ec) == it->second.mtime && !ec) {
+            std::string msg;
+            if (rewrite_in_place(path, it->second, names, vals, alias_of, refs, opts, msg)) {
+                if (!msg.empty()) {
+                    written_files.erase(it);
+                }
+                return msg;
+            }
+        }
+    }
+    written_files.erase(path);
+
+    mat_ft format = opts.auto_format ? choose_format(vals) : opts.format;
+    mat_t *matfp = Mat_CreateVer (filename.c_str(), NULL, format);
+
+    if (matfp == NULL) {
+        return "matiotest: could not create file";
+    }
+
+    // Encoding the properties is independent work, so it is spread over the
+    // worker pool, with up to nthreads - 1 helpers.  The file handle is only
+    // used from this thread, which writes the variables in order as soon as
+    // each one is ready and encodes the next unclaimed ones while it waits;
+    // with a single thread everything is encoded here, in order.  matio
+    // compresses inside Mat_VarWrite, so compression itself happens here and
+    // is counted in the write phase of the stats.
+    //
+    // Checksums are computed by the encoder threads too, on the same data
+    // that is handed to matio, and stored in two bookkeeping variables:
+    // _matiotest_crc (uint32) and _matiotest_crcnames (comma separated).
+    std::vector<encoded_var> vars (n);
+    std::vector<uint32_t> crcs (n, 0);
+    std::vector<char> has_crc (n, 0);
+    std::vector<char> ready (n, 0);
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    auto encode = [&] (std::size_t i) {
+        encoded_var ev;
+        try {
+            if (alias_of[i] >= 0) {
+                // Nothing to encode
+            } else {
+                phase_timer timer (io_stats::encode);
+                ev = write_var(names[i], vals[i]);
+                if (!is_meta_name(names[i])) {
+                    has_crc[i] = value_checksum(vals[i], crcs[i]);
+                }
+            }
+        } catch (...) {
+            // Reported as a failed variable below
+        }
+        std::lock_guard<std::mutex> lock (mtx);
+        vars[i] = ev;
+        ready[i] = 1;
+        cv.notify_one();
+    };
+    unsigned int helpers = (n > 1) ? static_cast<unsigned int> (std::min<std::size_t> (nthreads, n)) - 1 : 0;
+    std::shared_ptr<worker_pool::job> encoder = workers.start(n, helpers, encode);
+
+    std::string msg;
+    for (std::size_t i = 0; i < n; ++i) {
+        {
+            std::unique_lock<std::mutex> lock (mtx);
+            while (ready[i] == 0) {
+                lock.unlock();
+                bool ran = encoder->run_one();
+                lock.lock();
+                if (!ran) {
+                    cv.wait(lock, [&] () { return ready[i] != 0; });
+                }
+            }
+        }
+
+        if (alias_of[i] >= 0) {
+            continue;
+        }
+
+        if (vars[i].matvar == NULL) {
+            msg = "matiotest: could not create matvar_t object for variable '" + names[i] + "'";
+            encoder->cancel();
+            break;
+        }
+
+        int status;
+        {
+            phase_timer timer (io_stats::write);
+            status = Mat_VarWrite (matfp, vars[i].matvar, opts.compression);
+        }
+        if (status != 0) {
+            msg = "matiotest: could not write variable '" + names[i] + "'";
+            encoder->cancel();
+            break;
+        }
+        if (!is_meta_name(names[i])) {
+            stats.add_variable(names[i], vals[i].byte_size(), true);
+        }
+
+        vars[i] = encoded_var ();
+    }
+
+    encoder->wait();
+
+    if (msg.empty() && !write_checksums(matfp, names, crcs, has_crc)) {
+        msg = "matiotest: could not write the checksums";
+    }
+    if (msg.empty() && !write_index(matfp, names, vals, alias_of)) {
+        msg = "matiotest: could not write the property index";
+    }
+    if (msg.empty() && !refs.empty()) {
+        size_t ref_dims[2] = {1, refs.size()};
+        matvar_t *matvar = Mat_VarCreate ((meta_prefix + "refs").c_str(), MAT_C_CHAR, MAT_T_UTF8,
+                                          2, ref_dims, const_cast<char *> (refs.data()), 0);
+        if (matvar == NULL || Mat_VarWrite (matfp, matvar, MAT_COMPRESSION_NONE) != 0) {
+            msg = "matiotest: could not write the list of shared properties";
+        }
+        Mat_VarFree(matvar);
+    }
+
+    Mat_Close(matfp);
+
+    if (opts.incremental && msg.empty()) {
+        written_file& wf = written_files[path];
+        wf.refs = refs;
+        wf.compression = opts.compression;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (has_crc[i]) {
+                wf.crc_names.push_back(names[i]);
+            }
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            written_file::entry& e = wf.vars[names[i]];
+            e.value = vals[i];
+            e.written = (alias_of[i] < 0);
+            if (has_crc[i]) {
+                e.crc = crcs[i];
+                e.has_crc = true;
+            } else {
+                e.has_crc = value_checksum(vals[i], e.crc);
+            }
+        }
+        wf.mtime = std::filesystem::last_write_time(path, ec);
+    }
+
+    return msg;
+}
+
+void 
+writeclass(const std::string& filename,
+           const octave_scalar_map& st,
+           const io_options& opts)
+{
+    std::string msg = write_mat(filename, st, opts);
+    if (!msg.empty()) {
+        error("%s", msg.c_str());
+    }
+
+    // Read the file back; readclass checks the checksums as it goes
+    if (opts.verify) {
+        octave_scalar_map st2;
+        readclass(filename, st2);
+    }
+}
+
+// Background writer for 'async' saves.  The interpreter thread takes the
+// snapshot: saveobj runs there, and the resulting struct shares its data with
+// the object through octave_value's reference counts, so later changes to the
+// object copy on write and never touch the snapshot.  Encoding, compression
+// and writing then happen on a single writer thread, one job at a time in the
+// order they were submitted.  That thread never calls into the interpreter.
+class async_writer
+{
+public:
+    enum job_state { pending, running, done, failed };
+
+    async_writer() = default;
+
+    async_writer(const async_writer&) = delete;
+    async_writer& operator = (const async_writer&) = delete;
+
+    // Finish everything that was queued before the module goes away
+    ~async_writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    octave_idx_type submit(const std::string& filename, const octave_scalar_map& snapshot,
+                           const io_options& opts)
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+
+        if (!m_thread.joinable()) {
+            m_thread = std::thread ([this] () { run(); });
+        }
+
+        // Jobs that succeeded have nothing left to report, so they are
+        // forgotten here rather than only by wait (), which a program
+        // that never waits would not call.  Failed ones are kept until
+        // their error has been reported.
+        for (auto it = m_jobs.begin(); it != m_jobs.end(); ) {
+            if (it->second->state == done) {
+                it = m_jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        auto j = std::make_shared<job> ();
+        j->id = ++m_last_id;
+        j->filename = filename;
+        j->snapshot = snapshot;
+        j->opts = opts;
+
+        m_queue.push_back(j);
+        m_jobs[j->id] = j;
+        m_cv.notify_all();
+
+        return j->id;
+    }
+
+    // Block until job id (or every job, if id is 0) has finished.  Finished
+    // jobs are forgotten; the messages of the failed ones are returned.
+    std::vector<std::string> wait(octave_idx_type id)
+    {
+        std::unique_lock<std::mutex> lock (m_mutex);
+
+        std::vector<std::string> errors;
+        if (id > 0) {
+            auto it = m_jobs.find(id);
+            if (it == m_jobs.end()) {
+                return errors;
+            }
+            std::shared_ptr<job> j = it->second;
+            m_done.wait(lock, [&] () { return j->state == done || j->state == failed; });
+            if (j->state == failed) {
+                errors.push_back(j->message);
+            }
+            m_jobs.erase(id);
+        } else {
+            m_done.wait(lock, [&] () { return m_queue.empty() && !m_busy; });
+            for (const auto& kv : m_jobs) {
+                if (kv.second->state == failed) {
+                    errors.push_back(kv.second->message);
+                }
+            }
+            m_jobs.clear();
+        }
+
+        return errors;
+    }
+
+    // Block until no queued job writes to filename
+    void wait_file(const std::string& filename)
+    {
+        std::unique_lock<std::mutex> lock (m_mutex);
+
+        m_done.wait(lock, [&] () {
+            for (const auto& j : m_queue) {
+                if (j->filename == filename) {
+                    return false;
+                }
+            }
+            return !(m_busy && m_current == filename);
+        });
+    }
+
+    // Returns false if the job was never submitted.  A job that has been
+    // forgotten (see submit and wait) is reported as done.
+    bool state(octave_idx_type id, job_state& st)
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+
+        auto it = m_jobs.find(id);
+        if (it == m_jobs.end()) {
+            if (id <= 0 || id > m_last_id) {
+                return false;
+            }
+            st = done;
+            return true;
+        }
+        st = it->second->state;
+        return true;
+    }
+
+    octave_scalar_map status()
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+
+        double npending = 0, ndone = 0, nfailed = 0;
+        std::list<std::string> errors;
+        for (const auto& kv : m_jobs) {
+            switch (kv.second->state) {
+                case pending:
+                case running:
+                    npending++;
+                    break;
+                case done:
+                    ndone++;
+                    break;
+                case failed:
+                    nfailed++;
+                    errors.push_back(kv.second->message);
+                    break;
+            }
+        }
+
+        octave_scalar_map st;
+        st.assign("pending", npending);
+        st.assign("done", ndone);
+        st.assign("failed", nfailed);
+        st.assign("errors", Cell (string_vector (errors)));
+        return st;
+    }
+
+private:
+    struct job
+    {
+        octave_idx_type id = 0;
+        std::string filename;
+        octave_scalar_map snapshot;
+        io_options opts;
+        job_state state = pending;
+        std::string message;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock (m_mutex);
+
+        for (;;) {
+            m_cv.wait(lock, [this] () { return m_stop || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                break;
+            }
+
+            std::shared_ptr<job> j = m_queue.front();
+            m_queue.pop_front();
+            j->state = running;
+            m_busy = true;
+            m_current = j->filename;
+
+            lock.unlock();
+            std::string msg;
+            try {
+                msg = write_mat(j->filename, j->snapshot, j->opts);
+            } catch (const std::exception& e) {
+                msg = std::string ("matiotest: ") + e.what();
+            } catch (...) {
+                msg = "matiotest: unknown error while writing";
+            }
+            // Release the snapshot on this thread, it may be large
+            j->snapshot = octave_scalar_map ();
+            lock.lock();
+
+            j->message = msg;
+            j->state = msg.empty() ? done : failed;
+            m_busy = false;
+            m_done.notify_all();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done;
+    std::deque<std::shared_ptr<job>> m_queue;
+    std::map<octave_idx_type, std::shared_ptr<job>> m_jobs;
+    octave_idx_type m_last_id = 0;
+    bool m_busy = false;
+    std::string m_current;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+async_writer writer;
+
+// Raise the first error reported by async_writer::wait, if any
+void check_async_errors(const std::vector<std::string>& errors)
+{
+    if (!errors.empty()) {
+        if (errors.size() > 1) {
+            warning("matiotest: %zu background saves failed", errors.size());
+        }
+        error("%s", errors[0].c_str());
+    }
+}
+
+// Batch files hold many objects of one class.  Each property is stored once,
+// column-wise: the values of all objects are concatenated along a new
+// trailing dimension, so N objects with a 3x4 property give one 3x4xN
+// variable.  Properties whose values differ in type or size between objects
+// are stored as a cell array instead and listed in _matiotest_cellprops.
+// Properties where all objects share the same data are stored once and
+// listed in _matiotest_sharedprops.
+
+template <typename ArrayT>
+octave_value stack_as(const std::vector<octave_value>& vals, int dim)
+{
+    typedef typename ArrayT::element_type T;
+
+    std::vector<Array<T>> arrays;
+    arrays.reserve(vals.size());
+    for (const auto& val : vals) {
+        arrays.push_back(octave_value_extract<ArrayT> (val));
+    }
+
+    return ArrayT (Array<T>::cat (dim, arrays.size(), arrays.data()));
+}
+
+// Concatenate values of one type along dim (zero-based).  Returns an
+// undefined value for types that can't be concatenated this way.
+octave_value cat_values(const std::vector<octave_value>& vals, int dim)
+{
+    switch (vals[0].builtin_type()) {
+        case btyp_double:
+            return stack_as<NDArray> (vals, dim);
+        case btyp_float:
+            return stack_as<FloatNDArray> (vals, dim);
+        case btyp_complex:
+            return stack_as<ComplexNDArray> (vals, dim);
+        case btyp_float_complex:
+            return stack_as<FloatComplexNDArray> (vals, dim);
+        case btyp_int8:
+            return stack_as<int8NDArray> (vals, dim);
+        case btyp_int16:
+            return stack_as<int16NDArray> (vals, dim);
+        case btyp_int32:
+            return stack_as<int32NDArray> (vals, dim);
+        case btyp_int64:
+            return stack_as<int64NDArray> (vals, dim);
+        case btyp_uint8:
+            return stack_as<uint8NDArray> (vals, dim);
+        case btyp_uint16:
+            return stack_as<uint16NDArray> (vals, dim);
+        case btyp_uint32:
+            return stack_as<uint32NDArray> (vals, dim);
+        case btyp_uint64:
+            return stack_as<uint64NDArray> (vals, dim);
+        case btyp_bool:
+            return stack_as<boolNDArray> (vals, dim);
+        case btyp_char:
+            return stack_as<charNDArray> (vals, dim);
+        default:
+            return octave_value ();
+    }
+}
+
+// Returns an undefined value if the values can't be concatenated
+octave_value stack_values(const std::vector<octave_value>& vals)
+{
+    const octave_value& first = vals[0];
+    builtin_type_t btyp = first.builtin_type();
+    dim_vector dv = first.dims();
+
+    for (const auto& val : vals) {
+        if (val.issparse() || val.builtin_type() != btyp || val.dims() != dv) {
+            return octave_value ();
+        }
+    }
+
+    return cat_values(vals, dv.ndims());
+}
+
+// Value of object i out of count from a column-wise stacked property
+octave_value unstack_value(const octave_value& stacked, octave_idx_type count,
+                           octave_idx_type i)
+{
+    // With a single object there is no trailing dimension to strip
+    int k = (count > 1) ? stacked.ndims() - 1 : stacked.ndims();
+
+    octave_value_list idx (k + 1);
+    for (int j = 0; j < k; ++j) {
+        idx(j) = octave_value (octave_value::magic_colon_t);
+    }
+    idx(k) = octave_value (static_cast<double> (i + 1));
+
+    return stacked.index_op(idx);
+}
+
+// Flatten the third argument of a batch save into a list of objects.  It is
+// either a classdef object array or a cell array of objects; dv gets the
+// shape to restore on load.
+std::vector<octave_value> batch_objects(const octave_value& arg, dim_vector& dv)
+{
+    std::vector<octave_value> objs;
+
+    if (arg.iscell()) {
+        Cell c = arg.cell_value();
+        dv = c.dims();
+        for (octave_idx_type i = 0; i < c.numel(); ++i) {
+            if (!c(i).is_classdef_object()) {
+                error("matiotest: cell element %" OCTAVE_IDX_TYPE_FORMAT " is not a classdef object.", i+1);
+            }
+            objs.push_back(c(i));
+        }
+    } else {
+        Array<octave::cdef_object> arr = octave::to_cdef(arg).array_value();
+        dv = arr.dims();
+        for (octave_idx_type i = 0; i < arr.numel(); ++i) {
+            objs.push_back(octave::to_ov(arr(i)));
+        }
+    }
+
+    if (objs.empty()) {
+        error("matiotest: nothing to save.");
+    }
+
+    return objs;
+}
+
+// Take every object's snapshot (see object_snapshot) and stack them into the
+// struct that is written to the file
+octave_scalar_map batch_snapshot(const std::vector<octave_value>& objs, const dim_vector& dv)
+{
+    // The class is resolved once for the whole batch
+    octave::cdef_class cls = octave::to_cdef(objs[0]).get_class();
+    const class_info& info = timed_lookup_class(cls);
+
+    std::vector<octave_scalar_map> structs;
+    structs.reserve(objs.size());
+    for (const auto& obj : objs) {
+        if (!(octave::to_cdef(obj).get_class() == cls)) {
+            error("matiotest: all objects in a batch must be of class '%s'.", cls.get_name().c_str());
+        }
+        structs.push_back(object_snapshot(obj, info));
+    }
+
+    octave_scalar_map st;
+    std::string cellprops;
+    std::string sharedprops;
+
+    string_vector keys = structs[0].fieldnames();
+    for (octave_idx_type k = 0; k < keys.numel(); ++k) {
+        std::string key = keys(k);
+
+        std::vector<octave_value> vals;
+        vals.reserve(structs.size());
+        for (const auto& s : structs) {
+            if (!s.isfield(key)) {
+                error("matiotest: saveobj returned different fields for objects in the batch.");
+            }
+            vals.push_back(s.getfield(key));
+        }
+
+        // If every object refers to the same data it is stored once, and
+        // all the loaded objects share it again
+        bool shared = vals.size() > 1;
+        for (const auto& val : vals) {
+            if (&val.get_rep() != &vals[0].get_rep()) {
+                shared = false;
+                break;
+            }
+        }
+        if (shared) {
+            st.assign(key, vals[0]);
+            sharedprops += (sharedprops.empty() ? "" : ",") + key;
+            continue;
+        }
+
+        octave_value stacked = stack_values(vals);
+        if (stacked.is_undefined()) {
+            Cell c (dv);
+            for (std::size_t i = 0; i < vals.size(); ++i) {
+                c(i) = vals[i];
+            }
+            stacked = c;
+            cellprops += (cellprops.empty() ? "" : ",") + key;
+        }
+
+        st.assign(key, stacked);
+    }
+
+    Matrix dims (1, dv.ndims());
+    for (int j = 0; j < dv.ndims(); ++j) {
+        dims(j) = dv(j);
+    }
+
+    st.assign(meta_prefix + "count", static_cast<double> (objs.size()));
+    st.assign(meta_prefix + "dims", dims);
+    if (!cellprops.empty()) {
+        st.assign(meta_prefix + "cellprops", cellprops);
+    }
+    if (!sharedprops.empty()) {
+        st.assign(meta_prefix + "sharedprops", sharedprops);
+    }
+
+    return st;
+}
+
+// Comma separated list of property names in bookkeeping variable key
+std::set<std::string> read_name_list(const octave_scalar_map& meta, const std::string& key)
+{
+    std::set<std::string> names;
+    if (meta.isfield(meta_prefix + key)) {
+        std::istringstream list (meta.getfield(meta_prefix + key).string_value());
+        std::string name;
+        while (std::getline(list, name, ',')) {
+            names.insert(name);
+        }
+    }
+
+    return names;
+}
+
+// Rebuild the object array of a batch file in one pass over its properties
+octave_value read_batch(const octave_scalar_map& st, const octave_scalar_map& meta,
+                        const octave::cdef_class& cls)
+{
+    const class_info& info = timed_lookup_class(cls);
+
+    octave_idx_type count = meta.getfield(meta_prefix + "count").idx_type_value();
+
+    dim_vector dv (count, 1);
+    if (meta.isfield(meta_prefix + "dims")) {
+        NDArray dims = meta.getfield(meta_prefix + "dims").array_value();
+        dv.resize(std::max (static_cast<octave_idx_type> (2), dims.numel()), 1);
+        for (octave_idx_type j = 0; j < dims.numel(); ++j) {
+            dv(j) = static_cast<octave_idx_type> (dims(j));
+        }
+    }
+
+    std::set<std::string> cellprops = read_name_list(meta, "cellprops");
+    std::set<std::string> sharedprops = read_name_list(meta, "sharedprops");
+
+    Array<octave::cdef_object> objs (dv);
+    for (octave_idx_type i = 0; i < count; ++i) {
+        octave_scalar_map sti;
+        for (auto it = st.begin(); it != st.end(); ++it) {
+            const octave_value& val = st.contents(it);
+            if (sharedprops.count(it->first)) {
+                sti.assign(it->first, val);
+            } else if (cellprops.count(it->first)) {
+                sti.assign(it->first, val.cell_value()(i));
+            } else {
+                sti.assign(it->first, unstack_value(val, count, i));
+            }
+        }
+
+        objs(i) = octave::to_cdef(timed_load_object(info, sti));
+    }
+
+    if (count == 1) {
+        return octave::to_ov(objs(0));
+    }
+
+    octave::cdef_object arr (new octave::cdef_object_array (objs));
+    arr.set_class(cls);
+
+    return octave::to_ov(arr);
+}
+
+// Streaming writes.  matiotest ('append', ...) adds a chunk to a variable
+// in a v7.3 file through Mat_VarWriteAppend, so a property can be written
+// piece by piece along one dimension without ever holding all of it.  The
+// file stays open between calls.  Chunks are buffered per variable until
+// memcap bytes are pending, then concatenated and written with one append,
+// which keeps the number of (slow) HDF5 extensions down while bounding the
+// memory used.  A chunk larger than memcap is written on its own.
+struct stream_file
+{
+    struct pending
+    {
+        std::vector<octave_value> chunks;
+        std::size_t bytes = 0;
+
+        // Set by the first chunk of the variable; dim is 1-based
+        int dim = 0;
+        builtin_type_t btyp = btyp_unknown;
+        dim_vector dv;
+    };
+
+    mat_t *matfp = NULL;
+
+    // As passed to Mat_Open, which is the name HDF5 knows the file by
+    std::string filename;
+
+    matio_compression compression = MAT_COMPRESSION_NONE;
+    std::size_t memcap = 0;
+    std::map<std::string, pending> vars;
+
+    // The file already had variables when it was opened, and isn't a log
+    bool had_vars = false;
+
+    // Checkpoint logs (see log_snapshot): the number of snapshots and the
+    // last value appended to each variable
+    bool log = false;
+    octave_idx_type versions = 0;
+    std::map<std::string, octave_value> last;
+};
+
+// Keyed by absolute path; only used from the interpreter thread
+std::map<std::string, stream_file> stream_files;
+
+// Append val to variable name along dim (1-based)
+void append_value(stream_file& sf, const std::string& name, const octave_value& val, int dim)
+{
+    matvar_arena arena;
+    matvar_t *matvar;
+    {
+        phase_timer timer (io_stats::encode);
+        matvar = create_leaf(name, val, arena, dim);
+    }
+    if (matvar == NULL) {
+        error("matiotest: could not create matvar_t object for variable '%s'", name.c_str());
+    }
+
+    int status;
+    {
+        phase_timer timer (io_stats::write);
+        std::lock_guard<std::mutex> matio_lock (matio_mutex);
+        status = Mat_VarWriteAppend (sf.matfp, matvar, sf.compression, dim);
+    }
+    if (status != 0) {
+        error("matiotest: could not append to variable '%s'", name.c_str());
+    }
+
+    if (!is_meta_name(name)) {
+        stats.add_variable(name, val.byte_size(), true);
+    }
+}
+
+void flush_stream_var(stream_file& sf, const std::string& name, stream_file::pending& p)
+{
+    if (p.chunks.empty()) {
+        return;
+    }
+
+    octave_value val = (p.chunks.size() == 1) ? p.chunks[0] : cat_values(p.chunks, p.dim - 1);
+    p.chunks.clear();
+    p.bytes = 0;
+
+    append_value(sf, name, val, p.dim);
+}
+
+// An empty string may come back from the file as []
+std::vector<std::string> split_names(const octave_value& names)
+{
+    std::vector<std::string> retval;
+    if (!names.is_string()) {
+        return retval;
+    }
+
+    std::istringstream is (names.string_value());
+    std::string name;
+    while (std::getline(is, name, ',')) {
+        retval.push_back(name);
+    }
+
+    return retval;
+}
+
+// Variable holding property name of snapshot version when it can't be
+// appended to a log
+std::string log_var_name(octave_idx_type version, const std::string& name)
+{
+    return meta_prefix + "v" + std::to_string(version) + "_" + name;
+}
+
+// Variable listing (comma separated) the properties of snapshot version
+// that are stored with log_var_name.  Only written if there are any.
+std::string log_extra_name(octave_idx_type version)
+{
+    return meta_prefix + "v" + std::to_string(version);
+}
+
+// Marks a file as a checkpoint log from before its first snapshot on
+static const std::string log_marker = meta_prefix + "logfmt";
+
+// What a checkpoint log holds, found from its variables alone, so it can be
+// read while the log is still being written or after a crash (see
+// log_snapshot).  versions is the length of _matiotest_log, or -1 if the file
+// isn't a log.  dims has the dims of each appended variable; the last one
+// counts its records.  stale lists what an unfinished snapshot left behind.
+struct log_state
+{
+    octave_idx_type versions = -1;
+    std::map<std::string, std::vector<size_t>> dims;
+    std::vector<std::string> stale;
+    bool has_vars = false;
+};
+
+log_state read_log_state(mat_t *matfp)
+{
+    log_state state;
+
+    matvar_ptr marker (Mat_VarReadInfo(matfp, log_marker.c_str()));
+    matvar_ptr counter (Mat_VarReadInfo(matfp, (meta_prefix + "log").c_str()));
+    if (counter != NULL && marker == NULL) {
+        error("matiotest: the checkpoint log was written by an older version of matiotest");
+    }
+    if (counter != NULL) {
+        state.versions = static_cast<octave_idx_type> (counter->dims[1]);
+    } else if (marker != NULL) {
+        state.versions = 0;
+    }
+
+    std::string next_list = log_extra_name(state.versions + 1);
+    std::string next_var = log_var_name(state.versions + 1, "");
+
+    Mat_Rewind(matfp);
+    matvar_t *next;
+    while ( (next = Mat_VarReadNextInfo(matfp)) != NULL) {
+        matvar_ptr matvar (next);
+        std::string name (matvar->name);
+        state.has_vars = true;
+
+        if (!is_meta_name(name)) {
+            state.dims[name].assign(matvar->dims, matvar->dims + matvar->rank);
+        } else if (name == next_list || name.compare(0, next_var.size(), next_var) == 0) {
+            state.stale.push_back(name);
+        }
+    }
+
+    if (state.versions >= 0) {
+        for (const auto& kv : state.dims) {
+            if (kv.second.size() < 3 || kv.second.back() < static_cast<size_t> (state.versions)) {
+                error("matiotest: variable '%s' has fewer records than the log", kv.first.c_str());
+            }
+        }
+    }
+
+    return state;
+}
+
+#if defined (MAT73) && MAT73
+// The HDF5 file identifier behind a v7.3 file matio opened as filename, or
+// -1.  matio doesn't hand it out, so it is looked up among the open files.
+hid_t hdf5_file_id(const std::string& filename)
+{
+    ssize_t count = H5Fget_obj_count(H5F_OBJ_ALL, H5F_OBJ_FILE);
+    if (count <= 0) {
+        return -1;
+    }
+
+    std::vector<hid_t> ids (count);
+    count = H5Fget_obj_ids(H5F_OBJ_ALL, H5F_OBJ_FILE, count, ids.data());
+    for (ssize_t i = 0; i < count; ++i) {
+        ssize_t len = H5Fget_name(ids[i], NULL, 0);
+        if (len < 0) {
+            continue;
+        }
+        std::vector<char> name (len + 1);
+        H5Fget_name(ids[i], name.data(), name.size());
+        if (filename == name.data()) {
+            return ids[i];
+        }
+    }
+
+    return -1;
+}
+
+// Shrink the trailing (record) dimension of an appended variable.  HDF5
+// lists the dims in reverse, so it is the first one there.
+bool hdf5_truncate(hid_t fid, const std::string& name, hsize_t records)
+{
+    hid_t dset = H5Dopen2(fid, name.c_str(), H5P_DEFAULT);
+    if (dset < 0) {
+        return false;
+    }
+
+    herr_t status = -1;
+    hid_t space = H5Dget_space(dset);
+    int rank = (space >= 0) ? H5Sget_simple_extent_ndims(space) : -1;
+    if (rank > 0) {
+        std::vector<hsize_t> dims (rank);
+        H5Sget_simple_extent_dims(space, dims.data(), NULL);
+        dims[0] = records;
+        status = H5Dset_extent(dset, dims.data());
+    }
+    if (space >= 0) {
+        H5Sclose(space);
+    }
+    H5Dclose(dset);
+
+    return status >= 0;
+}
+#endif
+
+// Make what log_snapshot wrote so far durable
+void flush_log(stream_file& sf)
+{
+#if defined (MAT73) && MAT73
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
+    hid_t fid = hdf5_file_id(sf.filename);
+    if (fid < 0 || H5Fflush(fid, H5F_SCOPE_GLOBAL) < 0) {
+        error("matiotest: could not flush '%s'", sf.filename.c_str());
+    }
+#else
+    octave_unused_parameter(sf);
+#endif
+}
+
+// Drop the records and variables of a snapshot that never finished, so the
+// log can be added to again.  matio has the file open as filename.
+void repair_log(const std::string& filename, const log_state& state)
+{
+#if defined (MAT73) && MAT73
+    bool damaged = !state.stale.empty();
+    for (const auto& kv : state.dims) {
+        damaged = damaged || kv.second.back() > static_cast<size_t> (state.versions);
+    }
+    if (!damaged) {
+        return;
+    }
+
+    hid_t fid = hdf5_file_id(filename);
+    bool ok = (fid >= 0);
+    for (const auto& kv : state.dims) {
+        if (ok && kv.second.back() > static_cast<size_t> (state.versions)) {
+            ok = hdf5_truncate(fid, kv.first, state.versions);
+        }
+    }
+    for (const auto& name : state.stale) {
+        ok = ok && H5Ldelete(fid, name.c_str(), H5P_DEFAULT) >= 0;
+    }
+    if (!ok) {
+        error("matiotest: could not drop the unfinished snapshot of '%s'", filename.c_str());
+    }
+#else
+    octave_unused_parameter(filename);
+    octave_unused_parameter(state);
+#endif
+}
+
+// The stream of filename, opening the file if needed.  An existing file
+// must be v7.3; if it is a checkpoint log, its layout is read back so that
+// more snapshots can be added, and a snapshot cut short by a crash is
+// dropped first.
+stream_file& open_stream(const std::string& filename, const io_options& opts)
+{
+    std::string path = std::filesystem::absolute(filename).string();
+
+    auto it = stream_files.find(path);
+    if (it != stream_files.end()) {
+        return it->second;
+    }
+
+    writer.wait_file(filename);
+
+    mat_t *matfp = NULL;
+    log_state log;
+    {
+        std::lock_guard<std::mutex> matio_lock (matio_mutex);
+
+        // The file no longer matches what the last incremental save wrote
+        written_files.erase(path);
+
+        if (std::filesystem::exists(path)) {
+            mat_file existing (Mat_Open (filename.c_str(), MAT_ACC_RDWR));
+            if (existing != NULL && Mat_GetVersion(existing) != MAT_FT_MAT73) {
+                error("matiotest: 'append' and 'log' need a v7.3 file");
+            }
+            if (existing != NULL) {
+                log = read_log_state(existing);
+                if (log.versions >= 0) {
+                    repair_log(filename, log);
+                }
+            }
+            matfp = existing.release();
+        } else {
+            matfp = Mat_CreateVer (filename.c_str(), NULL, MAT_FT_MAT73);
+        }
+    }
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
+    }
+
+    // Open files must be flushed by 'close', so keep the module loaded
+    interp->mlock();
+
+    it = stream_files.emplace(path, stream_file ()).first;
+    stream_file& sf = it->second;
+    sf.matfp = matfp;
+    sf.filename = filename;
+    sf.compression = opts.compression;
+    sf.memcap = opts.memcap;
+
+    if (log.versions >= 0) {
+        sf.log = true;
+        sf.versions = log.versions;
+
+        // One record is the dataset without its last (version) dimension;
+        // the type is taken from the next record
+        for (const auto& kv : log.dims) {
+            dim_vector dv;
+            dv.resize(kv.second.size(), 1);
+            for (std::size_t j = 0; j + 1 < kv.second.size(); ++j) {
+                dv(j) = kv.second[j];
+            }
+            stream_file::pending& p = sf.vars[kv.first];
+            p.dim = dv.ndims();
+            p.dv = dv;
+        }
+    } else {
+        sf.had_vars = log.has_vars;
+    }
 
+    return sf;
+}
 
-                
-            //Mat_VarPrint(&fields[0], 1);
+// chunk with its size extended to dim dimensions
+dim_vector chunk_dims(const octave_value& chunk, int dim)
+{
+    dim_vector dv = chunk.dims();
+    dv.resize(std::max (dim, dv.ndims()), 1);
+    return dv;
+}
 
-            //Mat_VarFree(fields);
-            break;
-        }
-        default:
-            octave_stdout << "DEFAULT\n";
-            octave_stdout << "Variable "
-                          << matvar->name
-                          << ": Unknown class type "
-                          << ".\n";
+// Whether chunk can be appended to variable p along dim
+bool stream_matches(const stream_file::pending& p, const octave_value& chunk, int dim)
+{
+    if (p.dim == 0) {
+        return true;
+    }
+
+    dim_vector dv = chunk_dims(chunk, dim);
+    bool same = (dim == p.dim && dv.ndims() == p.dv.ndims()
+                 && (p.btyp == btyp_unknown || chunk.builtin_type() == p.btyp));
+    for (int j = 0; same && j < dv.ndims(); ++j) {
+        same = (j == dim - 1 || dv(j) == p.dv(j));
     }
+
+    return same;
 }
 
-void readclass(const std::string& filename, octave_scalar_map& st)
+void stream_push(stream_file& sf, const std::string& name, const octave_value& chunk, int dim)
 {
-    mat_t *matfp = Mat_Open (filename.c_str(), MAT_ACC_RDONLY);
+    stream_file::pending& p = sf.vars[name];
 
-    if (matfp == NULL) {
-        error("matiotest: could not open file");
+    if (!stream_matches(p, chunk, dim)) {
+        error("matiotest: chunk for '%s' does not match the type or size of the earlier ones",
+              name.c_str());
     }
+    if (p.dim == 0) {
+        p.dim = dim;
+        p.dv = chunk_dims(chunk, dim);
+    }
+    p.btyp = chunk.builtin_type();
 
-#ifndef NDEBUG
-    octave_stdout << "Header: " << Mat_GetHeader(matfp) << "\n";
-#endif
+    std::size_t bytes = chunk.byte_size();
+    if (p.bytes > 0 && p.bytes + bytes > sf.memcap) {
+        flush_stream_var(sf, name, p);
+    }
 
-    // Iterate through the variables in the MAT file
-    matvar_t *matvar; 
-    while ( (matvar = Mat_VarReadNext(matfp)) != NULL) {
+    p.chunks.push_back(chunk);
+    p.bytes += bytes;
+    if (p.bytes >= sf.memcap) {
+        flush_stream_var(sf, name, p);
+    }
+}
 
+void stream_append(const std::string& filename, const std::string& name,
+                   const octave_value& chunk, const io_options& opts)
+{
+    // Char data is written as UTF-16 or, if it isn't all text, UTF-8 (see
+    // create_char), so two chunks of one variable could disagree on the
+    // data type of the dataset
+    if (chunk.issparse() || !(chunk.isnumeric() || chunk.islogical())) {
+        error("matiotest: 'append' only supports dense numeric and logical chunks.");
+    }
 
-#ifndef NDEBUG
-        octave_stdout << "===== Variable data =========\n";
-        Mat_VarPrint(matvar, 0);
-        octave_stdout << "===== END Variable data =====\n";
-#endif
+    stream_file& sf = open_stream(filename, opts);
+    if (sf.log) {
+        error("matiotest: '%s' is a checkpoint log, use 'w' with 'log' to add to it",
+              filename.c_str());
+    }
 
-        // std::string does a deep copy
-        std::string name (matvar->name);
+    int dim = (opts.dim > 0) ? opts.dim : chunk.ndims();
+    stream_push(sf, name, chunk, dim);
+}
 
-        get_var(matvar, st); 
+// Write what is still buffered and close the file.  Does nothing if
+// filename isn't being streamed to.
+void stream_close(const std::string& filename)
+{
+    std::error_code ec;
+    auto it = stream_files.find(std::filesystem::absolute(filename, ec).string());
+    if (it == stream_files.end()) {
+        return;
+    }
 
-        octave_stdout << "Variable '" << name << "' has been read.\n";
+    stream_file& sf = it->second;
+    std::string msg;
+    for (auto& kv : sf.vars) {
+        try {
+            flush_stream_var(sf, kv.first, kv.second);
+        } catch (const octave::execution_exception&) {
+            // Close the file anyway, and report the first failure below
+            if (msg.empty()) {
+                msg = "matiotest: could not append to variable '" + kv.first + "'";
+            }
+        }
+    }
 
-        Mat_VarFree(matvar);
+    {
+        std::lock_guard<std::mutex> matio_lock (matio_mutex);
+        Mat_Close(sf.matfp);
     }
+    stream_files.erase(it);
 
-#ifndef NDEBUG
-    octave_stdout << "===== Contents of struct ========\n";
-    for (auto it = st.begin(); it != st.end(); ++it) {
-        octave_stdout << "Field '" << it->first << "' has value: ";
-        st.getfield(it->first).short_disp(octave_stdout);
-        octave_stdout << "\n";
+    if (!msg.empty()) {
+        error("%s", msg.c_str());
     }
-    octave_stdout << "===== END Contents of struct ====\n";
-#endif
+}
 
-    Mat_Close(matfp);
+void stream_close_all()
+{
+    while (!stream_files.empty()) {
+        stream_close(stream_files.begin()->first);
+    }
 }
 
-octave_value_list
-loadobj(const octave_scalar_map& st,
-        //octave::cdef_object& obj,
-        octave_value obj, // this is the cdef_object that is constructed.
-        octave::cdef_method& loadobj_method)
+// Checkpoint logs.  Saving the same object every few iterations with
+// matiotest ('w', filename, obj, 'log', true) keeps one v7.3 file open and
+// adds each snapshot as a new record of the file's variables: a dense
+// numeric or logical property is appended along an extra trailing "version"
+// dimension, so the file is created once per run rather than once per
+// checkpoint.  The properties of the first snapshot fix which variables are
+// appended and the size of their records.  Anything else (structs, cells,
+// strings, sparse matrices, properties added later, or a value whose type or
+// size changed) is written as its own variable, named by log_var_name and
+// listed in log_extra_name; an appended variable then gets a copy of its
+// previous record so the versions stay aligned.
+//
+// Nothing is ever rewritten.  Records are appended right away rather than
+// buffered up to memcap, and a snapshot is committed by appending its number
+// to _matiotest_log and flushing the file, so it is on disk when this
+// returns.  The number of snapshots is the length of _matiotest_log, which a
+// reader gets without the log being closed (see read_log_state); a snapshot
+// that a crash cut short isn't counted, and is dropped when the log is
+// opened again.  _matiotest_logfmt marks the file as a log until the first
+// snapshot is committed.  Returns the number of the new snapshot.
+octave_idx_type log_snapshot(const std::string& filename, const octave_scalar_map& st,
+                             const io_options& opts)
 {
-    octave_value_list args;
-    octave_value_list retval;
+    stream_file& sf = open_stream(filename, opts);
+    if (!sf.log) {
+        if (!sf.vars.empty()) {
+            error("matiotest: '%s' is open for 'append', not as a checkpoint log",
+                  filename.c_str());
+        }
+        if (sf.had_vars) {
+            error("matiotest: '%s' already holds variables and is not a checkpoint log",
+                  filename.c_str());
+        }
 
-    // TODO: Instead of forcing 'obj' to be a parameters, try to push object variable onto the stack frame of the call
+        encoded_var ev = write_var(log_marker, octave_value (1.0));
+        {
+            std::lock_guard<std::mutex> matio_lock (matio_mutex);
+            if (ev.matvar == NULL || Mat_VarWrite (sf.matfp, ev.matvar, MAT_COMPRESSION_NONE) != 0) {
+                error("matiotest: could not start a checkpoint log in '%s'", filename.c_str());
+            }
+        }
+        sf.log = true;
+    }
 
-    /*
-        // In the scope of the method, we'll add a default-constructed object
-        // Maybe in the global scope?
-        //octave::interpreter* interp = octave::interpreter::the_interpreter();
-        //octave::tree_evaluator& eval = interp->get_evaluator();
-        //interp->global_assign("abc", octave_value(1));
+    // Check everything before the first record is added, so a failed
+    // snapshot doesn't leave the variables with different lengths
+    for (const auto& kv : sf.vars) {
+        if (!st.isfield(kv.first)) {
+            error("matiotest: property '%s' is missing from the snapshot", kv.first.c_str());
+        }
+    }
 
-        octave::tree_evaluator& eval = interp->get_evaluator();
-        eval.top_level_assign("abc", octave_value(1));
+    std::vector<std::string> names = sorted_fields(st);
+    std::vector<char> appended (names.size(), 0);
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        const octave_value val = st.getfield(names[i]);
+        bool appendable = !val.issparse() && (val.isnumeric() || val.islogical());
+        int dim = val.ndims() + 1;
 
-        auto names = interp->top_level_variable_names();
-        for (auto& name : names) {
-            octave_stdout << "Global variable: " << name << "\n";
+        auto p = sf.vars.find(names[i]);
+        if (p == sf.vars.end()) {
+            appended[i] = (appendable && sf.versions == 0);
+        } else if (appendable && stream_matches(p->second, val, dim)) {
+            appended[i] = 1;
+        } else if (sf.last.find(names[i]) == sf.last.end()) {
+            error("matiotest: property '%s' changed type or size since the log was reopened",
+                  names[i].c_str());
         }
-        //interp->set_global_value("abc", octave_value(2));
+    }
 
-        octave_stdout << "Stack frame num: " << eval.current_call_stack_frame_number() << "\n";;
+    octave_idx_type version = sf.versions + 1;
+    try {
+        std::string extra;
+        for (std::size_t i = 0; i < names.size(); ++i) {
+            const std::string& name = names[i];
+            octave_value val = st.getfield(name);
 
-        // We pass in a struct, and expect a new object to be created
+            if (appended[i]) {
+                stream_file::pending& p = sf.vars[name];
+                if (p.dim == 0) {
+                    p.dim = val.ndims() + 1;
+                    p.dv = chunk_dims(val, p.dim);
+                }
+                p.btyp = val.builtin_type();
+                append_value(sf, name, val, p.dim);
+                sf.last[name] = val;
+                continue;
+            }
 
-        octave_stdout << "Stack frame num: " << eval.current_call_stack_frame_number() << "\n";;
-        octave::unwind_protect up; 
+            auto p = sf.vars.find(name);
+            if (p != sf.vars.end()) {
+                append_value(sf, name, sf.last[name], p->second.dim);
+            }
 
-        octave::symbol_scope ss = eval.get_current_scope();
+            encoded_var ev;
+            {
+                phase_timer timer (io_stats::encode);
+                ev = write_var(log_var_name(version, name), val);
+            }
+            if (ev.matvar == NULL) {
+                error("matiotest: could not create matvar_t object for variable '%s'", name.c_str());
+            }
+            int status;
+            {
+                phase_timer timer (io_stats::write);
+                std::lock_guard<std::mutex> matio_lock (matio_mutex);
+                status = Mat_VarWrite (sf.matfp, ev.matvar, sf.compression);
+            }
+            if (status != 0) {
+                error("matiotest: could not write variable '%s'", name.c_str());
+            }
+            stats.add_variable(name, val.byte_size(), true);
 
-        if (ss.is_variable("abc")) {
-            octave_stdout << "abc found in symbol table.\n";
-        } else {
-            octave_stdout << "abc not found in symbol table.\n";
+            extra += (extra.empty() ? "" : ",") + name;
         }
 
-        octave::symbol_scope ss_top = interp->get_top_scope();
-        if (ss_top.is_variable("abc")) {
-            octave_stdout << "abc found in symbol table.\n";
-        } else {
-            octave_stdout << "abc not found in symbol table.\n";
+        if (!extra.empty()) {
+            encoded_var ev = write_var(log_extra_name(version), octave_value (extra));
+            int status = -1;
+            if (ev.matvar != NULL) {
+                std::lock_guard<std::mutex> matio_lock (matio_mutex);
+                status = Mat_VarWrite (sf.matfp, ev.matvar, MAT_COMPRESSION_NONE);
+            }
+            if (status != 0) {
+                error("matiotest: could not write the snapshot's variable list");
+            }
         }
-        //obj.set_property (1, "data", retval(0));
-    */
 
+        append_value(sf, meta_prefix + "log", octave_value (static_cast<double> (version)), 2);
+        flush_log(sf);
+    } catch (const octave::execution_exception&) {
+        // Don't add to the partial snapshot; opening the log again drops it
+        stream_close(filename);
+        throw;
+    }
 
-    args(0) = octave_value(obj);
-    args(1) = octave_value(st);
-    retval = loadobj_method.execute (args, 1);
+    sf.versions = version;
 
-    return retval;
+    return version;
 }
 
-octave_scalar_map saveobj(
-    octave_value obj, // this is the cdef_object 
-    octave::cdef_method& loadobj_method)
+// Read snapshot version of a checkpoint log (see log_snapshot), 0 for the
+// last.  Each appended variable contributes one record, read as a hyperslab,
+// so the cost doesn't grow with the number of snapshots in the file.  Only
+// committed snapshots count, so this also works on a log that is still open
+// elsewhere or was never closed.  Returns false if filename isn't a log.
+bool read_log(const std::string& filename, octave_idx_type version, octave_scalar_map& st)
 {
-    octave_value_list args;
-    args(0) = obj; 
-    octave_value_list retval = loadobj_method.execute(obj, 1);
+    std::lock_guard<std::mutex> matio_lock (matio_mutex);
 
-    if (!retval(0).is_defined() || !retval(0).isstruct()) {
-        error("matiotest: saveobj method did not return a scalar map.");
+    mat_file matfp (Mat_Open (filename.c_str(), MAT_ACC_RDONLY));
+
+    if (matfp == NULL) {
+        error("matiotest: could not open file");
     }
 
-    octave_scalar_map st = retval(0).scalar_map_value();
-    
-    return st;
-}
+    log_state log = read_log_state(matfp);
+    if (log.versions < 0) {
+        return false;
+    }
 
-matvar_t*
-write_var(const std::string& name, octave_value val)
-{
-    dim_vector dims_v = val.dims();
-    int rank = dims_v.ndims();
+    octave_idx_type versions = log.versions;
+    if (versions == 0) {
+        error("matiotest: the checkpoint log has no snapshots yet");
+    }
+    if (version == 0) {
+        version = versions;
+    }
+    if (version > versions) {
+        error("matiotest: version %" OCTAVE_IDX_TYPE_FORMAT " requested, but the log has %"
+              OCTAVE_IDX_TYPE_FORMAT, version, versions);
+    }
 
-    size_t *dims = (size_t*) &dims_v.elem(0); // Guaranteed that index elem 0 exists
-    
-    matvar_t *matvar = NULL;
+    std::vector<std::string> extra;
+    matvar_ptr list (Mat_VarReadInfo(matfp, log_extra_name(version).c_str()));
+    if (list != NULL) {
+        extra = split_names(read_var(matfp, list.get()));
+    }
+    for (const auto& name : extra) {
+        matvar_ptr matvar (Mat_VarReadInfo(matfp, log_var_name(version, name).c_str()));
+        if (matvar == NULL) {
+            error("matiotest: variable '%s' not found in file", name.c_str());
+        }
+        octave_value val;
+        {
+            phase_timer timer (io_stats::read);
+            val = read_var(matfp, matvar.get());
+        }
+        st.assign(name, val);
+        stats.add_variable(name, val.byte_size(), false);
+    }
 
-    octave_stdout << "How many times for " << val.type_id() << "?\n";
-    switch (val.type_id()) {
-        case 0: { // bytp_double
-            octave_stdout << "is a double scalar\n";
-            break;
+    for (const auto& kv : log.dims) {
+        const std::string& name = kv.first;
+        if (st.isfield(name)) {
+            continue;
         }
-        case 1: { // btyp_float
-            octave_stdout << "is a scalar\n";
-            // Get the underlying pointer
-            break;
+
+        matvar_ptr matvar (Mat_VarReadInfo(matfp, name.c_str()));
+        if (matvar == NULL) {
+            error("matiotest: variable '%s' not found in file", name.c_str());
         }
-        case 12: { // btyp_char
-            octave_stdout << "is a char array\n";
-            // Get the underlying pointer
-            const char* data = val.char_array_value().data();
-                matvar = Mat_VarCreate (name.c_str(), MAT_C_CHAR, MAT_T_UTF8, rank, dims, data, 0);
-            break;
+
+        // One record is the dataset without its last (version) dimension
+        int vdim = static_cast<int> (kv.second.size()) - 1;
+        dim_vector dv;
+        dv.resize(vdim, 1);
+        for (int j = 0; j < vdim; ++j) {
+            dv(j) = kv.second[j];
         }
-        case 13: { // btyp_struct
-            octave_stdout << "is a struct\n";
-            break;
+
+        hyperslab hs = full_hyperslab(matvar.get());
+        hs.start[vdim] = static_cast<int> (version - 1);
+        hs.edge[vdim] = 1;
+
+        octave_value val;
+        {
+            phase_timer timer (io_stats::read);
+            val = read_block(matfp, matvar.get(), hs);
         }
-        case 14: { // btyp_cell
-            octave_stdout << "is a cell array\n";
-            break;
+        if (val.is_undefined()) {
+            error("matiotest: variable '%s' can't be read from the log", name.c_str());
         }
+
+        val = val.reshape(dv);
+        st.assign(name, val);
+        stats.add_variable(name, val.byte_size(), false);
     }
-    octave_stdout << "never, apparently?\n";
 
-    return matvar;
+    return true;
 }
 
-void 
-writeclass(const std::string& filename,
-           octave_scalar_map st)
+// Load many files of one class, e.g. a series of checkpoints.  The files
+// are opened and decoded on a pool of worker threads, each with its own
+// mat_t handle.  v5 files are decoded concurrently; v7.3 files take turns
+// on matio_mutex, since HDF5 is not thread safe.  Checking the results,
+// rebuilding the objects and loadobj then run here, on the interpreter
+// thread, which must own all cdef calls.  The result is a cell array of
+// objects with the shape of files.
+octave_value load_files(const Cell& files, const octave::cdef_class& cls,
+                        const io_options& opts)
 {
-    mat_t *matfp = Mat_CreateVer (filename.c_str(), NULL, MAT_FT_MAT73);
+    std::size_t n = files.numel();
 
-    if (matfp == NULL) {
-        error("matiotest: could not create file");
+    std::vector<std::string> names (n);
+    for (std::size_t i = 0; i < n; ++i) {
+        names[i] = files(i).string_value();
+        writer.wait_file(names[i]);
+        stream_close(names[i]);
     }
 
-    for (auto it = st.begin(); it != st.end(); ++it) {
-        octave_stdout << "property '" << it->first << "' has value: " << st.getfield(it->first).string_value() << "\n";
+    unsigned int nthreads = opts.threads;
+    if (nthreads == 0) {
+        nthreads = std::max (1u, std::thread::hardware_concurrency ());
+    }
 
-        dim_vector dims_v = st.getfield(it->first).dims();
-        int rank = dims_v.ndims();
+    std::vector<decoded_file> decoded (n);
+    parallel_for (n, nthreads, [&] (std::size_t i) {
+        try {
+            decoded[i] = decode_file(names[i]);
+        } catch (const std::exception& e) {
+            decoded[i].error = e.what();
+        }
+    });
 
-        size_t *dims = (size_t*) &dims_v.elem(0); // Guaranteed that index elem 0 exists
-        // We've gotta convert dims to a const size_t* pointer ourselves; it's ugly, but needs to be done, since the pointer is private in dim_vector
-        // size_t *dims = new size_t[rank];
-        
-        matvar_t *matvar = write_var(it->first, st.getfield(it->first));
-        if (matvar == NULL) {
-            error("matiotest: could not create matvar_t object for variable '%s'", it->first.c_str());
+    Cell retval (files.dims());
+    for (std::size_t i = 0; i < n; ++i) {
+        decoded_file& df = decoded[i];
+        if (!df.error.empty()) {
+            df.error += " (" + names[i] + ")";
         }
+        finish_decode(df);
+        raise_struct(df.st);
 
-        Mat_VarWrite (matfp, matvar, MAT_COMPRESSION_NONE);
+        if (df.meta.isfield(meta_prefix + "count")) {
+            retval(i) = read_batch(df.st, df.meta, cls);
+        } else {
+            retval(i) = timed_load_object(timed_lookup_class(cls), df.st);
+        }
 
-        Mat_VarFree(matvar);
+        // Done with this file's data
+        df = decoded_file ();
     }
 
-    Mat_Close(matfp);
-
-    octave_stdout << "====== TEST =========" << "\n";
-    const char* hello = "Hello, world!"; // 13 characters
-    octave_stdout << "Size of string: " << strlen(hello) << "\n";
-    octave_stdout << "====== END TEST ===== " << "\n";
-
-    // Let's verify that the file was created with all the right variables
-    octave_scalar_map st2;
-    readclass(filename, st2);
+    return retval;
 }
 
-//
-//
-// Parameters:
-//  arg0: 'r' or 'w'
-//  arg1: filename
-//  arg2: classname (if loading), or object (if saving)
-DEFUN_DLD (matiotest, args, nargout,
-           "MATLAB io save method")
+// The body of matiotest, see below
+octave_value_list
+matiotest_main(const octave_value_list& args, int nargout)
 {
     octave_idx_type nargin = args.length ();
 
     // We're going to check that all the parameters are valid before we start loading or saving anything.
 
-    if (nargin < 3 || nargin > 3) {
-        error ("matiotest: Invalid number of input arguments. Expected 3.");
+    if (nargin < 1) {
+        error ("matiotest: Invalid number of input arguments.");
     }
 
     if (!(args(0).is_defined() && args(0).is_string())) {
@@ -342,107 +4970,309 @@ DEFUN_DLD (matiotest, args, nargout,
 
     std::string opt = args(0).string_value ();
 
+    if (opt == "wait" || opt == "flush") {
+        octave_idx_type id = 0;
+        if (nargin > 1) {
+            id = args(1).xidx_type_value("matiotest: job id must be an integer.");
+        }
+        check_async_errors (writer.wait (id));
+        return octave_value_list ();
+    }
+
+    if (opt == "status") {
+        if (nargin == 1) {
+            return ovl (writer.status ());
+        }
+        octave_idx_type id = args(1).xidx_type_value("matiotest: job id must be an integer.");
+        async_writer::job_state st;
+        if (!writer.state (id, st)) {
+            error ("matiotest: unknown job id %" OCTAVE_IDX_TYPE_FORMAT, id);
+        }
+        static const char *names[] = {"pending", "running", "done", "failed"};
+        return ovl (names[st]);
+    }
+
+    if (opt == "verbose") {
+        int old = verbosity;
+        if (nargin > 1) {
+            verbosity = args(1).xint_value("matiotest: verbosity must be an integer.");
+        }
+        return ovl (old);
+    }
+
+    if (opt == "stats") {
+        octave_scalar_map st = stats.to_map ();
+        if (nargin > 1) {
+            if (args(1).string_value () != "reset") {
+                error ("matiotest: 'stats' only takes the option 'reset'.");
+            }
+            stats.reset ();
+        }
+        return ovl (st);
+    }
+
+    if (opt == "pool") {
+        std::string action = (nargin > 1) ? args(1).xstring_value ("matiotest: 'pool' action must be a string.")
+                                          : "stats";
+#if defined (OCTAVE_HAVE_STD_PMR_POLYMORPHIC_ALLOCATOR)
+        buffer_pool& pool = decode_pool ();
+        if (action == "on") {
+            double capacity = 1 << 30;
+            if (nargin > 2) {
+                capacity = args(2).xdouble_value ("matiotest: pool capacity must be a number.");
+                if (capacity < 0) {
+                    error ("matiotest: pool capacity must be non-negative.");
+                }
+            }
+            // Pooled arrays call back into this module when they are freed,
+            // so it must stay loaded from now on
+            interp->mlock ();
+            pool.enable (static_cast<std::size_t> (capacity));
+        } else if (action == "off") {
+            pool.disable ();
+        } else if (action == "trim") {
+            pool.trim ();
+        } else if (action != "stats") {
+            error ("matiotest: 'pool' action must be 'on', 'off', 'trim' or 'stats'.");
+        }
+        return ovl (pool.stats ());
+#else
+        if (action == "on") {
+            error ("matiotest: buffer pools need an Octave built with std::pmr support.");
+        }
+        if (action != "off" && action != "trim" && action != "stats") {
+            error ("matiotest: 'pool' action must be 'on', 'off', 'trim' or 'stats'.");
+        }
+        octave_scalar_map st;
+        st.setfield ("enabled", false);
+        return ovl (st);
+#endif
+    }
+
+    if (opt == "clearcache") {
+        clear_class_cache ();
+        return octave_value_list ();
+    }
+
+    if (opt == "fetch") {
+        if (nargin < 3 || nargin > 4 || !args(1).is_string() || !args(2).is_string()) {
+            error ("matiotest: 'fetch' expects a filename, a variable name and optionally a cache.");
+        }
+        std::string filename = args(1).string_value ();
+        std::string name = args(2).string_value ();
+
+        // A placeholder's cache (see make_placeholder)
+        octave_value cache = (nargin == 4) ? args(3) : octave_value ();
+        if (cache.is_defined() && interp->feval("isKey", ovl(cache, name), 1)(0).bool_value()) {
+            Cell key (1, 1);
+            key(0) = name;
+            return ovl (interp->feval("values", ovl(cache, key), 1)(0).cell_value()(0));
+        }
+
+        writer.wait_file (filename);
+        stream_close (filename);
+
+        raise_context ctx;
+        octave_value val = raise_value (fetch_var (filename, name), ctx);
+
+        if (cache.is_defined()) {
+            // containers.Map is a handle, so this updates the shared cache
+            std::list<octave_value_list> idx (1, ovl(name));
+            cache.subsasgn ("(", idx, val);
+        }
+        return ovl (val);
+    }
+
+    if (opt == "ls") {
+        if (nargin != 2 || !args(1).is_string()) {
+            error ("matiotest: 'ls' expects a filename.");
+        }
+        writer.wait_file (args(1).string_value ());
+        stream_close (args(1).string_value ());
+        return ovl (list_file (args(1).string_value ()));
+    }
+
+    if (opt == "get") {
+        if (nargin != 3 || !args(1).is_string()
+            || !(args(2).is_string() || args(2).iscellstr())) {
+            error ("matiotest: 'get' expects a filename and a name or a cell array of names.");
+        }
+        std::string filename = args(1).string_value ();
+        writer.wait_file (filename);
+        stream_close (filename);
+
+        octave_scalar_map st = get_vars (filename, args(2).xstring_vector_value ("matiotest: names must be strings."));
+        raise_struct (st);
+        if (args(2).is_string()) {
+            return ovl (st.getfield (args(2).string_value ()));
+        }
+        return ovl (st);
+    }
+
+    if (opt == "append") {
+        if (nargin < 4 || !args(1).is_string() || !args(2).is_string()) {
+            error ("matiotest: 'append' expects a filename, a variable name and a chunk.");
+        }
+        stream_append (args(1).string_value (), args(2).string_value (), args(3),
+                       parse_options (args, 4));
+        return octave_value_list ();
+    }
+
+    if (opt == "close") {
+        if (nargin == 1) {
+            stream_close_all ();
+        } else {
+            stream_close (args(1).xstring_value ("matiotest: filename must be a string."));
+        }
+        return octave_value_list ();
+    }
+
+    if (nargin < 3) {
+        error ("matiotest: Invalid number of input arguments. Expected at least 3.");
+    }
+
+    if (opt == "r" && nargin > 3 && args(3).is_string()
+        && args(3).string_value() == "slice") {
+        if (nargin < 5 || !args(1).is_string() || !args(4).is_string()) {
+            error ("matiotest: 'slice' expects a filename, a class name and a variable name.");
+        }
+        std::string filename = args(1).string_value ();
+        writer.wait_file (filename);
+        stream_close (filename);
+
+        return ovl (read_slice (filename, args(4).string_value (),
+                                args.slice (5, nargin - 5)));
+    }
+
+    io_options opts = parse_options (args, 3);
+
     octave_value obj;
-    octave::cdef_method loadobj_method;
-    octave::cdef_method saveobj_method;
 
     octave_value_list retval (nargout);
     if (opt == "r") {
-        if (!(args(1).is_defined() && args(1).is_string())) {
-            error ("matiotest: Second argument must be a string for a filename to read from."); 
+        if (!(args(1).is_defined() && (args(1).is_string() || args(1).iscellstr()))) {
+            error ("matiotest: Second argument must be a string for a filename to read from, or a cell array of them."); 
         }
-        std::string filename = args(1).string_value();
 
+        octave::cdef_class cls;
         if (args(2).is_defined() && args(2).is_string()) {
             // Check to see if the string represents a class name
-            octave::cdef_class cls = cdef_mgr.find_class(args(2).string_value());
+            const class_info& info = timed_lookup_class(args(2).string_value(), "matiotest");
+            cls = info.cls;
 
-            if (!cls.is_class()) {
-                error("matiotest: Class not found: ");
-            } else {
-                octave_stdout << "Found class: " << cls.get_name() << "\n";
+            // A loadobj method is optional: without one the properties are
+            // assigned directly (see load_object).  If there is one, it must
+            // be static.
+            if (info.loadobj.ok() && !info.loadobj.is_static()) {
+                error("matiotest: Class 'loadobj' method is not static.");
             }
 
-            // We do a check to see if the class has a loadobj method
-            //octave_value loadobj_method = cls.get_method_function("loadobj");
-            std::map<std::string, octave::cdef_method> m = cls.get_method_map();
-
-            if (m.find("loadobj") == m.end()) {
-                error("matiotest: Class does not have a loadobj method.");
+            if (opts.lazy && !info.loadobj.ok()) {
+                error("matiotest: 'lazy' needs a class with a loadobj method.");
             }
+        } else {
+            error("matiotest: If \"r\" is specified, third argument must be a valid class name.");
+        }
 
-            // Verify that loadobj is a static method
-            if (!m["loadobj"].is_static()) {
-                error("matiotest: Class 'loadobj' method is not static.");
+        if (args(1).iscellstr()) {
+            if (opts.lazy) {
+                error("matiotest: 'lazy' is not supported when loading several files.");
             }
+            retval(0) = load_files(args(1).cell_value(), cls, opts);
+            return retval;
+        }
+        std::string filename = args(1).string_value();
 
-            loadobj_method = m["loadobj"];
+        writer.wait_file(filename);
+        stream_close(filename);
+        octave_scalar_map st;
+        octave_scalar_map meta;
 
-            /*
-            octave_fcn_handle *loadobj_method_handle = loadobj_method.fcn_handle_value();
-            if (loadobj_method_handle->is_defined() && loadobj_method_handle->is_function_handle()) {
-                octave_stdout << "has a loadobj method.\n";
-            } else {
-                error("matiotest: Class does not have a loadobj method.");
+        // Only v7.3 files can be checkpoint logs
+        if ((opts.version > 0 || needs_matio_lock(filename))
+            && read_log(filename, opts.version, st)) {
+            if (opts.lazy) {
+                error("matiotest: 'lazy' is not supported for checkpoint logs.");
             }
-            */
-    
-            // This snippet doesn't work (why?)
-            //     cls.initialize_object(obj);
-            //     out = octave::to_ov(obj);
-            
-            // We're gonna just assume that ConstructOnLoad = true for now
-            obj = cls.construct(octave_value_list());
+            raise_struct(st);
+        } else if (opts.version > 0) {
+            error("matiotest: 'version' needs a file written with 'log'.");
+        } else if (opts.lazy) {
+            readclass_lazy(filename, st, meta);
         } else {
-            error("matiotest: If \"r\" is specified, third argument must be a valid class name.");
+            readclass(filename, st, &meta);
+            raise_struct(st);
         }
 
-        octave_stdout << "Reading from MAT file: " << filename << "\n";
-        octave_scalar_map st;
-        readclass(filename, st);
+        if (meta.isfield(meta_prefix + "count")) {
+            if (opts.lazy) {
+                error("matiotest: 'lazy' is not supported for batch files.");
+            }
+            retval(0) = read_batch(st, meta, cls);
+        } else {
+            retval(0) = timed_load_object(timed_lookup_class(cls), st);
+        }
 
-        retval = loadobj(st, obj, loadobj_method);
+        if (verbosity >= 1) {
+            octave_stdout << "matiotest: loaded " << cls.get_name() << " from " << filename << "\n";
+        }
     } else if (opt == "w") {
-        octave_stdout << "Writing to MAT file.\n";
-
         // We'll test if we can actually open the file later
         if (!(args(1).is_defined() && args(1).is_string())) {
             error ("matiotest: Second argument must be a string for a filename to write to."); 
         }
         std::string filename = args(1).string_value();
 
-        // Name of object to get
-        if (args(2).is_defined() && args(2).is_string()) {
+        octave_scalar_map st;
+
+        // The object itself, or the name of a variable holding it
+        obj = args(2);
+        if (obj.is_string()) {
             // Reach into the interpreter to get the object
-            obj = interp->find("m");
+            obj = interp->find(obj.string_value());
+        }
 
+        if (obj.iscell() || (obj.is_classdef_object() && octave::to_cdef(obj).is_array())) {
+            // Many objects of one class go into a single batch file
+            dim_vector dv;
+            std::vector<octave_value> objs = batch_objects(obj, dv);
+            st = batch_snapshot(objs, dv);
+        } else {
             if (!(obj.is_classdef_object())) {
                 error("matiotest: Third argument must be a classdef object.");
             }
 
-            // Make sure that obj has a loadobj method, get a handle to it
-            // We'll find the class name and see if the 'loadobj' method exists, and then get the handle from it 
-            octave::cdef_class cls = cdef_mgr.find_class(obj.class_name());
+            // saveobj is optional, as loadobj is when loading
+            const class_info& info = timed_lookup_class(octave::to_cdef(obj).get_class());
+            st = object_snapshot(obj, info);
+        }
 
-            std::map<std::string, octave::cdef_method> m = cls.get_method_map();
-            if (m.find("saveobj") == m.end()) {
-                error("matiotest: Class does not have a saveobj method.");
-            }
+        // Nested objects are turned into structs here, on the interpreter
+        // thread, before any encoding starts
+        st = lower_struct(st);
 
-            if (m["saveobj"].is_static()) {
-                error("matiotest: 'saveobj' method should not be static.");
+        // Now we have a struct, we can write it to the MAT file
+        if (opts.log) {
+            if (opts.async || opts.incremental) {
+                error("matiotest: 'log' can't be combined with 'async' or 'incremental'.");
             }
-
-            saveobj_method = m["saveobj"];
-
-            octave_scalar_map st = saveobj(obj, m["saveobj"]); 
-
-            // Now we have a struct, we can write it to the MAT file
-
-            writeclass(filename, st);
-        
+            retval(0) = octave_value(log_snapshot(filename, st, opts));
+        } else if (opts.async) {
+            // The writer thread must outlive this call, so don't let
+            // 'clear matiotest' unload the module while saves are pending
+            interp->mlock();
+            retval(0) = octave_value(writer.submit(filename, st, opts));
+        } else {
+            writer.wait_file(filename);
+            stream_close(filename);
+            writeclass(filename, st, opts);
             retval(0) = octave_value(1);
         }
+
+        if (verbosity >= 1) {
+            octave_stdout << "matiotest: " << (opts.async ? "queued " : opts.log ? "logged " : "saved ")
+                          << st.nfields() << " properties to " << filename << "\n";
+        }
     } else {
         error ("matiotest: First argument must be 'r' or 'w'.");
     }
@@ -454,9 +5284,460 @@ DEFUN_DLD (matiotest, args, nargout,
     */
     //retval(0) = out;
 
-    octave_stdout << "=====END OF MATIO TEST=====\n";
     return retval;
 }
 
+//
+//
+// Parameters:
+//  arg0: 'r' or 'w'
+//  arg1: filename.  When loading, this may also be a cell array of
+//        filenames, which are decoded in parallel (see load_files); the
+//        result is then a cell array of objects.
+//  arg2: classname (if loading), or object (if saving).  When saving, this
+//        may also be an object array or a cell array of objects, which are
+//        written to a single batch file (see batch_snapshot); loading a batch
+//        file returns the object array.  A string names the variable that
+//        holds the object.  Its class may define saveobj (returning a
+//        struct) and a static loadobj (obj, s); without them the saved
+//        properties are written and assigned back (see object_snapshot).
+//        Properties may hold structs, cell arrays and other classdef
+//        objects, nested up to 128 levels deep (see max_nesting_depth).
+//        Handles shared between properties, and cycles of handles, come
+//        back as one object each (see lower_value).
+//  arg3...: options as name/value pairs
+//      'lazy', true    pass loadobj a struct of placeholders (see
+//                      make_placeholder).  loadobj must call them to get
+//                      the values, e.g.  obj.x = s.x ();  assigning s.x
+//                      itself stores the function handle.  The first call
+//                      reads and checks the variable; later calls return
+//                      the cached value.
+//      'compression'   'none' (default) or 'zlib'
+//      'format'        'auto' (default), 'v5', 'v7' or 'v73'.  'auto' writes
+//                      v5 (v7 with compression) unless a property may be
+//                      over the 2 GiB v5 limit, then v7.3 (see
+//                      choose_format).  Loading detects the format.
+//      'threads', n    number of encoder (or, when loading several files,
+//                      decoder) threads, 0 (default) for one per core
+//      'verify', true  read the file back after writing and check checksums
+//      'async', true   return a job id right away and write the file on a
+//                      background thread ('verify' is ignored)
+//      'incremental', true
+//                      write v7.3 and, on the next incremental save of the
+//                      same file, only overwrite the properties that
+//                      changed, in place (see rewrite_in_place).  If
+//                      properties were added or removed, or one changed
+//                      class or size or isn't a dense numeric or logical
+//                      array, or 'compression' is on, the file is written
+//                      again in full.
+//      'log', true     add the object as the next snapshot of a checkpoint
+//                      log and return its number (see log_snapshot).  The
+//                      snapshot is on disk when the call returns; the file
+//                      stays open until 'close' or until it is read
+//      'version', k    load snapshot k of a checkpoint log instead of the
+//                      last one
+//
+//  matiotest ('wait') blocks until all background saves are done, and
+//  matiotest ('wait', id) until job id is; failed saves raise an error.
+//  matiotest ('flush') is the same as matiotest ('wait').
+//  matiotest ('status') returns a struct with the number of pending, done and
+//  failed jobs, and matiotest ('status', id) one of 'pending', 'running',
+//  'done' or 'failed'.  Jobs are forgotten once they have been waited for,
+//  and successful ones also when a later save is queued; the counts leave
+//  them out and ('status', id) reports them as 'done'.
+//
+//  matiotest ('verbose', n) sets how much is printed and returns the old
+//  level: 0 (default) nothing, 1 a line per save or load, 2 also a line per
+//  variable read, 3 also matio's dump of each variable.
+//
+//  matiotest ('stats') returns a struct of counters since the module was
+//  loaded: time (seconds) and calls per phase (lookup, saveobj, lower,
+//  encode, write, read, decode, raise, loadobj), variables and bytes written
+//  and read, bytes per property and the number and size of the arrays
+//  allocated for reading.  Compression happens inside the matio write call
+//  and is part of write.  matiotest ('stats', 'reset') also clears them.
+//
+//  matiotest ('pool', 'on') recycles the buffers of loaded arrays between
+//  loads (see buffer_pool), keeping up to 1 GiB of freed buffers, or
+//  capacity bytes with matiotest ('pool', 'on', capacity).  'off' stops and
+//  frees the cached buffers, 'trim' only frees them, and 'stats' (also
+//  the default) returns the pool's counters.  Every action returns them.
+//  Turning the pool on locks the module in memory.
+//
+//  matiotest ('clearcache') drops the cached class metadata (see classcache.h).
+//
+//  matiotest ('fetch', filename, varname) reads a single variable, and
+//  matiotest ('fetch', filename, varname, cache) first looks it up in the
+//  containers.Map cache and stores it there; this is what the lazy
+//  placeholders call.
+//
+//  matiotest ('r', filename, classname, 'slice', varname, idx1, idx2, ...)
+//  returns a sub-block of one numeric variable.  Each idx is ':' or an
+//  increasing range with constant stride, e.g. 1:100 or 5.
+//
+//  matiotest ('ls', filename) returns the directory of a file as a struct
+//  array with fields name, class, dims, bytes and ref, without reading any
+//  property data (see write_index).
+//  matiotest ('get', filename, name) reads a single property, and
+//  matiotest ('get', filename, {name1, name2, ...}) a struct of several.
+//
+//  matiotest ('append', filename, varname, chunk, ...) appends chunk to
+//  variable varname of a v7.3 file along its last dimension (see
+//  stream_file).  chunk must be a dense numeric or logical array.  Options:
+//      'memcap', bytes buffer up to this many bytes per variable before
+//                      writing (default 64 MiB)
+//      'dim', d        append along dimension d instead
+//      'compression'   as above; only the call that opens the file counts
+//  matiotest ('close', filename) writes what is still buffered and closes
+//  the file; matiotest ('close') closes all of them.  Reading or saving an
+//  object to the same file closes it first.
+DEFUN_DLD (matiotest, args, nargout,
+           "MATLAB io save method")
+{
+    // The decoding functions throw read_error instead of calling error (),
+    // since they also run on worker threads
+    try {
+        return matiotest_main (args, nargout);
+    } catch (const read_error& e) {
+        error ("%s", e.what ());
+    }
+}
+
+/*
+%!shared dir, file
+%! dir = tempname ();
+%! mkdir (dir);
+%! fid = fopen (fullfile (dir, "mt_pair.m"), "w");
+%! fprintf (fid, "classdef mt_pair\n  properties\n    a\n    b\n  end\nend\n");
+%! fclose (fid);
+%! fid = fopen (fullfile (dir, "mt_node.m"), "w");
+%! fprintf (fid, "classdef mt_node < handle\n  properties\n    name\n    next\n  end\nend\n");
+%! fclose (fid);
+%! fid = fopen (fullfile (dir, "mt_lazy.m"), "w");
+%! fprintf (fid, "classdef mt_lazy\n  properties\n    x\n  end\n  methods (Static)\n");
+%! fprintf (fid, "    function obj = loadobj (obj, s)\n      obj.x = s.x;\n    end\n  end\nend\n");
+%! fclose (fid);
+%! addpath (dir);
+%! file = fullfile (dir, "obj.mat");
+
+%!test
+%! q = mt_pair ();
+%! q.a = sparse ([1 0; 0 2]);
+%! q.b = {true, "text"};
+%! p = mt_pair ();
+%! p.a = struct ("x", {1, "two"}, "y", {{int8([1 2]), {single(3)}}, []});
+%! p.b = {q, [q q]};
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (isequal (r.a, p.a));
+%! assert (isa (r.b{1}, "mt_pair"));
+%! assert (isequal (r.b{1}.a, q.a));
+%! assert (isequal (r.b{1}.b, q.b));
+%! assert (size (r.b{2}), [1 2]);
+%! assert (isequal (r.b{2}(2).b, q.b));
+
+%!test
+%! v = 1;
+%! for k = 1:30
+%!   s = struct ();
+%!   s.v = v;
+%!   v = {s};
+%! endfor
+%! p = mt_pair ();
+%! p.a = v;
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (isequal (r.a, v));
+
+%!error <nested more than 128 levels>
+%! v = 1;
+%! for k = 1:100
+%!   s = struct ();
+%!   s.v = v;
+%!   v = {s};
+%! endfor
+%! p = mt_pair ();
+%! p.a = v;
+%! matiotest ("w", file, p);
+
+%!test
+%! n1 = mt_node ();
+%! n1.name = "one";
+%! n2 = mt_node ();
+%! n2.name = "two";
+%! n1.next = n2;
+%! n2.next = n1;
+%! p = mt_pair ();
+%! p.a = n1;
+%! p.b = {n2, n1};
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a.name, "one");
+%! assert (r.a.next.name, "two");
+%! assert (r.a.next.next == r.a);
+%! assert (r.b{1} == r.a.next);
+%! assert (r.b{2} == r.a);
+
+%!test
+%! n = mt_node ();
+%! n.name = "shared";
+%! p = mt_pair ();
+%! p.a = {n};
+%! p.b = struct ("node", n);
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a{1} == r.b.node);
+%! r.a{1}.name = "changed";
+%! assert (r.b.node.name, "changed");
+
+%!test
+%! p = mt_pair ();
+%! p.a = rand (1000);
+%! p.b = 1;
+%! matiotest ("w", file, p, "incremental", true);
+%! p.b = 2;
+%! matiotest ("stats", "reset");
+%! matiotest ("w", file, p, "incremental", true);
+%! s = matiotest ("stats");
+%! assert (s.vars_written, 1);
+%! assert (s.bytes_written, 8);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, p.a);
+%! assert (r.b, 2);
+
+%!test
+%! log = fullfile (dir, "log.mat");
+%! p = mt_pair ();
+%! p.a = [1 2 3];
+%! p.b = "first";
+%! assert (matiotest ("w", log, p, "log", true), 1);
+%! p.a = [4 5 6];
+%! p.b = "second";
+%! assert (matiotest ("w", log, p, "log", true), 2);
+%! r = matiotest ("r", log, "mt_pair", "version", 1);
+%! assert (r.a, [1 2 3]);
+%! assert (r.b, "first");
+%! r = matiotest ("r", log, "mt_pair");
+%! assert (r.a, [4 5 6]);
+%! assert (r.b, "second");
+
+%!test
+%! p = mt_pair ();
+%! p.a = complex ([1 2], 0);
+%! p.b = {complex(single (3), 0), sparse (complex ([1 0 2], 0))};
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (isequal (r.a, [1 2]));
+%! assert (isequal (r.b{1}, single (3)));
+%! assert (isequal (r.b{2}, sparse ([1 0 2])));
+
+%!test
+%! p = mt_pair ();
+%! p.a = magic (4);
+%! p.b = "async";
+%! id = matiotest ("w", file, p, "async", true);
+%! p.a = 0;
+%! matiotest ("wait", id);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, magic (4));
+%! assert (r.b, "async");
+%! id2 = matiotest ("w", file, p, "async", true);
+%! matiotest ("wait");
+%! assert (matiotest ("status", id), "done");
+%! assert (matiotest ("status", id2), "done");
+%! s = matiotest ("status");
+%! assert ([s.pending, s.done, s.failed], [0, 0, 0]);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, 0);
+
+%!test
+%! p = mt_lazy ();
+%! p.x = magic (5);
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_lazy", "lazy", true);
+%! assert (is_function_handle (r.x));
+%! assert (r.x (), magic (5));
+%! assert (r.x (), magic (5));
+%! ## Change one element of the stored data; the fetch must notice
+%! fid = fopen (file, "r");
+%! bytes = fread (fid, Inf, "uint8=>uint8")';
+%! fclose (fid);
+%! k = strfind (char (bytes), char (typecast (17, "uint8")));
+%! assert (numel (k), 1);
+%! bytes(k:k+7) = typecast (18, "uint8");
+%! fid = fopen (file, "w");
+%! fwrite (fid, bytes, "uint8");
+%! fclose (fid);
+%! r = matiotest ("r", file, "mt_lazy", "lazy", true);
+%! fail ("r.x ()", "checksum mismatch");
+
+%!test
+%! p = mt_pair ();
+%! p.a = reshape (1:60, 6, 10);
+%! p.b = int16 (reshape (1:24, 2, 3, 4));
+%! matiotest ("w", file, p);
+%! assert (matiotest ("r", file, "mt_pair", "slice", "a", 2:2:6, 3), p.a(2:2:6, 3));
+%! assert (matiotest ("r", file, "mt_pair", "slice", "a", ":", 1:3:10), p.a(:, 1:3:10));
+%! assert (matiotest ("r", file, "mt_pair", "slice", "a", 4), p.a(4, :));
+%! assert (matiotest ("r", file, "mt_pair", "slice", "b", 2, ":", 2:3), p.b(2, :, 2:3));
+
+%!error <must be increasing>
+%! matiotest ("r", file, "mt_pair", "slice", "a", [3 1]);
+
+%!test
+%! p = mt_pair ();
+%! p.a = 1;
+%! p.b = "one";
+%! q = mt_pair ();
+%! q.a = [2 3];
+%! q.b = "two";
+%! matiotest ("w", file, [p q]);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (size (r), [1 2]);
+%! assert (r(1).a, 1);
+%! assert (r(1).b, "one");
+%! assert (r(2).a, [2 3]);
+%! assert (r(2).b, "two");
+%! matiotest ("w", file, {q; p});
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (size (r), [2 1]);
+%! assert (r(1).a, [2 3]);
+%! assert (r(2).b, "one");
+
+%!test
+%! f = fullfile (dir, "stream.mat");
+%! matiotest ("append", f, "x", [1; 2], "memcap", 0);
+%! matiotest ("append", f, "x", [3; 4]);
+%! matiotest ("append", f, "y", int32 ([1 2 3]), "dim", 1);
+%! matiotest ("append", f, "y", int32 ([4 5 6]), "dim", 1);
+%! matiotest ("close", f);
+%! matiotest ("append", f, "x", [5; 6]);
+%! matiotest ("close");
+%! assert (matiotest ("fetch", f, "x"), [1 3 5; 2 4 6]);
+%! assert (matiotest ("fetch", f, "y"), int32 ([1 2 3; 4 5 6]));
+
+%!error <dense numeric and logical>
+%! matiotest ("append", fullfile (dir, "stream.mat"), "z", "text");
+
+%!test
+%! p = mt_pair ();
+%! p.a = magic (3);
+%! p.b = {"text", 1};
+%! matiotest ("w", file, p);
+%! d = matiotest ("ls", file);
+%! assert (sort ({d.name}), {"a", "b"});
+%! a = d(strcmp ({d.name}, "a"));
+%! assert (a.class, "double");
+%! assert (a.dims, [3 3]);
+%! assert (a.bytes, 72);
+%! assert (isempty (a.ref));
+%! assert (matiotest ("get", file, "a"), magic (3));
+%! s = matiotest ("get", file, {"a", "b"});
+%! assert (s.a, magic (3));
+%! assert (s.b, {"text", 1});
+
+%!test
+%! files = {fullfile(dir, "m1.mat"), fullfile(dir, "m2.mat"), fullfile(dir, "m3.mat")};
+%! for k = 1:3
+%!   p = mt_pair ();
+%!   p.a = k * ones (k);
+%!   p.b = sprintf ("file %d", k);
+%!   matiotest ("w", files{k}, p);
+%! endfor
+%! r = matiotest ("r", files, "mt_pair", "threads", 2);
+%! assert (size (r), [1 3]);
+%! for k = 1:3
+%!   assert (r{k}.a, k * ones (k));
+%!   assert (r{k}.b, sprintf ("file %d", k));
+%! endfor
+
+%!error <missing\.mat>
+%! matiotest ("r", {file, fullfile(dir, "missing.mat")}, "mt_pair");
+
+%!test
+%! p = mt_pair ();
+%! p.a = sparse ([1 0 0; 0 0 2.5; 0 -1 0]);
+%! p.b = [1+2i, 3-4i; 0, 5i];
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (issparse (r.a));
+%! assert (r.a, p.a);
+%! assert (r.b, p.b);
+%! p.a = sparse ([true false; false true]);
+%! p.b = {sparse ([1i 0 2]), single ([1i 2])};
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (islogical (r.a) && issparse (r.a));
+%! assert (r.a, p.a);
+%! assert (r.b{1}, p.b{1});
+%! assert (r.b{2}, p.b{2});
+
+%!test
+%! e_acute = char ([195 169]);
+%! smiley = char ([240 159 152 128]);
+%! clef = char ([240 157 132 158]);
+%! long_ascii = repmat ("0123456789abcdef", 1, 5);
+%! p = mt_pair ();
+%! p.a = {"ab", long_ascii, [long_ascii(1:37) e_acute long_ascii], ...
+%!        [smiley " and " clef], [repmat("x", 1, 40) smiley]};
+%! p.b = ["first row "; "second row"];
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, p.a);
+%! assert (r.b, p.b);
+%! p.a = [e_acute long_ascii clef];
+%! p.b = char ([97 255 98]);
+%! matiotest ("w", file, p);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, p.a);
+%! assert (r.b, p.b);
+
+%!test
+%! p = mt_pair ();
+%! p.a = rand (20);
+%! p.b = "format";
+%! hdr = @() fileread (file)(1:10);
+%! matiotest ("w", file, p);
+%! assert (hdr (), "MATLAB 5.0");
+%! matiotest ("w", file, p, "compression", "zlib");
+%! assert (hdr (), "MATLAB 5.0");
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, p.a);
+%! matiotest ("w", file, p, "format", "v73");
+%! assert (hdr (), "MATLAB 7.3");
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, p.a);
+%! assert (r.b, p.b);
 
+%!test
+%! p = mt_pair ();
+%! p.a = rand (100);
+%! p.b = int16 (1:10);
+%! matiotest ("w", file, p);
+%! have_pool = true;
+%! try
+%!   s0 = matiotest ("pool", "on", 2^24);
+%! catch
+%!   ## Octave without std::pmr
+%!   have_pool = false;
+%! end_try_catch
+%! r = matiotest ("r", file, "mt_pair");
+%! clear r
+%! r = matiotest ("r", file, "mt_pair");
+%! if (have_pool)
+%!   s = matiotest ("pool", "stats");
+%!   assert (s.enabled);
+%!   assert (s.hits > s0.hits);
+%! endif
+%! s = matiotest ("pool", "off");
+%! assert (s.enabled, false);
+%! assert (r.a, p.a);
+%! assert (r.b, p.b);
+%! r = matiotest ("r", file, "mt_pair");
+%! assert (r.a, p.a);
 
+%!test
+%! rmpath (dir);
+%! confirm_recursive_rmdir (false, "local");
+%! rmdir (dir, "s");
+*/
@@ -6,10 +6,15 @@
 
 #include <octave/ov-struct.h>
 
+#include <octave/ls-oct-binary.h>
 #include <octave/ls-oct-text.h>
+#include <octave/mach-info.h>
 
 #include <octave/interpreter.h>
 
+#include "classcache.h"
+
+#include <fstream>
 #include <iostream>
 
 // args: octave_value_list
@@ -21,7 +26,7 @@ DEFUN_DLD (saveclass, args, nargout,
 
     if (nargin < 1) {
         error("saveclass: at least one input argument is required.");
-    } else if (nargin > 2) {
+    } else if (nargin > 4) {
         error("saveclass: too many input arguments.");
     }
 
@@ -31,35 +36,102 @@ DEFUN_DLD (saveclass, args, nargout,
     } 
     octave::cdef_object obj = octave::to_cdef(args(0));
 
-    // Check if the second argument is a string for a valid filename.
-    // If no second argument, then use the same name as the class.
+    // The remaining arguments are an optional filename and format flags.
+    // If no filename is given, then use the same name as the class.
+    // Octave's binary format is the default, '-text' is there for debugging.
+    // '-verbose' lists the saved properties.
     std::string filename = obj.class_name();
-    if (nargin == 2) {
-        if (!args(1).is_string()) {
-            error("saveclass: second argument must be a string.");
+    bool text = false;
+    bool verbose = false;
+    bool have_filename = false;
+    for (octave_idx_type i = 1; i < nargin; i++) {
+        if (!args(i).is_string()) {
+            error("saveclass: filename and options must be strings.");
+        }
+        std::string arg = args(i).string_value();
+        if (arg == "-text") {
+            text = true;
+        } else if (arg == "-binary") {
+            text = false;
+        } else if (arg == "-verbose") {
+            verbose = true;
+        } else if (!have_filename) {
+            filename = arg;
+            have_filename = true;
+        } else {
+            error("saveclass: unknown option '%s'", arg.c_str());
         }
-        filename = args(1).string_value();
     }
 
-    std::ofstream outf(filename);
+    std::ofstream outf(filename, std::ios::out | std::ios::binary);
     if (!outf) {
         error("saveclass: could not open file for writing.");
     }
 
     // Get the class properties
-    std::map<octave::property_key, octave::cdef_property> properties = obj.get_class().get_property_map();
+    const class_info& info = lookup_class(obj.get_class());
 
     // Save all the values to a struct
-    octave_scalar_map st;
-    for (const auto& property : properties) {
-        // Get the property name
-        std::string property_name = property.first.second;
-        octave_value property_value = obj.get_property(0, property_name);
-        octave_stdout << "Property: " << property_name << " has property value: " << property_value.string_value() << "\n";
-        st.assign(property_name, property_value);
+    octave_value st;
+    if (obj.is_array()) {
+        // An object array becomes a struct array of the same shape, with
+        // one field per property
+        Array<octave::cdef_object> objs = obj.array_value();
+        octave_map m (objs.dims());
+        for (const auto& property : info.properties) {
+            if (!property.is_saved()) {
+                continue;
+            }
+            Cell vals (objs.dims());
+            for (octave_idx_type i = 0; i < objs.numel(); i++) {
+                vals(i) = objs(i).get_property(0, property.name);
+            }
+            m.assign(property.name, vals);
+        }
+        st = m;
+    } else {
+        octave_scalar_map m;
+        for (const auto& property : info.properties) {
+            // Transient, Dependent, Constant and NoSave properties are not
+            // saved, and their values are never computed
+            if (!property.is_saved()) {
+                continue;
+            }
+
+            // Get the property name
+            const std::string& property_name = property.name;
+            octave_value property_value = obj.get_property(0, property_name);
+            m.assign(property_name, property_value);
+        }
+        st = m;
     }
 
-    save_text_data(outf, st, filename, true, 0);
+    if (verbose) {
+        octave_map m = st.map_value();
+        for (auto it = m.begin(); it != m.end(); ++it) {
+            const Cell& vals = m.contents(it);
+            octave_stdout << "saveclass: " << m.key(it) << ": "
+                          << (vals.numel() == 1 ? vals(0).class_name() : "per element")
+                          << " " << (vals.numel() == 1 ? vals(0).dims() : vals.dims()).str() << "\n";
+        }
+    }
+
+    if (text) {
+        save_text_data(outf, st, filename, true, 0);
+    } else {
+        // Same header as Octave's own binary files, so the result can also
+        // be read back with load
+        octave::mach_info::float_format flt_fmt = octave::mach_info::native_float_format();
+        outf << (octave::mach_info::words_big_endian() ? "Octave-1-B" : "Octave-1-L");
+        char fmt_digit = (flt_fmt == octave::mach_info::flt_fmt_ieee_big_endian) ? 1 : 0;
+        outf.write(&fmt_digit, 1);
+
+        save_binary_data(outf, st, filename, "", false, false);
+    }
+
+    if (!outf) {
+        error("saveclass: error while writing file.");
+    }
 
 
     // Return empty matrices for any outputs